@@ -0,0 +1,47 @@
+// startup benchmark: on(from,to) = fn vs bulk on({...}), rules registered in key order and shuffled
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "fsm.hpp"
+
+template<typename F>
+double ms( const F &fn ) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+int main() {
+    for( int transitions : { 10000, 100000, 1000000 } ) {
+        int hits = 0;
+        fsm::call fn = [&]( const fsm::args &args ) { ++hits; };
+
+        std::vector<fsm::rule> sorted;
+        sorted.reserve( transitions );
+        for( int i = 0; i < transitions; ++i ) {
+            sorted.push_back( { 256 + i / 16, 256 + i % 16, fn } );
+        }
+        std::vector<fsm::rule> shuffled( sorted );
+        std::shuffle( shuffled.begin(), shuffled.end(), std::mt19937( 1 ) );
+
+        // timed up to the first lookup, which settles whatever on() appended
+        for( const std::vector<fsm::rule> *rules : { &sorted, &shuffled } ) {
+            double one_by_one = ms( [&] {
+                fsm::stack fsm;
+                for( auto &r : *rules ) {
+                    fsm.on( r.from, r.trigger ) = r.fn;
+                }
+                fsm.handles( rules->front().from, rules->front().trigger );
+            } );
+            double bulk = ms( [&] {
+                fsm::stack fsm;
+                fsm.on( *rules );
+                fsm.handles( rules->front().from, rules->front().trigger );
+            } );
+            std::cout << transitions << ( rules == &sorted ? " sorted" : " shuffled" ) << " transitions: on() " << one_by_one << " ms, bulk on() " << bulk << " ms" << std::endl;
+        }
+    }
+}
@@ -17,14 +17,33 @@
 #define FSM_VERSION "0.0.0" // (2014/02/15) Initial version */
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <deque>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+// only fsync is needed from the OS: declared here so that <unistd.h> does not leak names like close() into user code.
+// features that need more of POSIX live in their own header for the same reason (fsm_shm.hpp, fsm_jit.hpp)
+#ifdef _WIN32
+extern "C" int _commit( int );
+#else
+extern "C" int fsync( int );
+#endif
+
 namespace fsm
 {
     template<typename T>
@@ -40,29 +59,189 @@ namespace fsm
 
     typedef std::vector<std::string> args;
     typedef std::function< void( const fsm::args &args ) > call;
+    // handles up to `count` repetitions of a trigger at once; returns how many it consumed (ie, until a state change).
+    // a call always counts as at least one repetition
+    typedef std::function< size_t( const fsm::args &args, size_t count ) > repeat_call;
+
+    // multiplicity tag: stack::command( tick, fsm::repeat(12000) )
+    struct repeat {
+        size_t count;
+        explicit repeat( size_t count ) : count(count)
+        {}
+    };
+
+    // shared args: copying a state (into the log, across machines) never copies strings.
+    // reads look like the fsm::args vector it replaces; writes (push_back, edit()...) copy the strings first unless
+    // this payload is their only holder, and drop the interned id.
+    struct payload {
+        std::shared_ptr<fsm::args> ptr;
+        unsigned id;
+
+        payload() : id(0)
+        {}
+        payload( fsm::args args ) : ptr( args.empty() ? 0 : std::make_shared<fsm::args>( std::move(args) ) ), id(0)
+        {}
+
+        const fsm::args &get() const {
+            static const fsm::args none;
+            return ptr ? *ptr : none;
+        }
+        operator const fsm::args &() const {
+            return get();
+        }
+        const std::string &operator[]( size_t pos ) const {
+            return get()[pos];
+        }
+        fsm::args::const_iterator begin() const {
+            return get().begin();
+        }
+        fsm::args::const_iterator end() const {
+            return get().end();
+        }
+        size_t size() const {
+            return get().size();
+        }
+        bool empty() const {
+            return get().empty();
+        }
+
+        fsm::args &edit() {
+            if( !ptr || ptr.use_count() != 1 ) {
+                ptr = std::make_shared<fsm::args>( get() );
+            }
+            id = 0;
+            return *ptr;
+        }
+        void push_back( const std::string &arg ) {
+            edit().push_back( arg );
+        }
+        void pop_back() {
+            edit().pop_back();
+        }
+        void clear() {
+            ptr.reset();
+            id = 0;
+        }
+    };
+
+    // interned payloads are deduplicated into a process-wide table and never released, so their ids are stable.
+    // id 0 is reserved for the empty payload.
+    inline fsm::payload intern( const fsm::args &args ) {
+        static std::mutex mutex;
+        static std::map< fsm::args, unsigned > ids;
+        static std::deque< fsm::payload > pool( 1 );
+        if( args.empty() ) {
+            return fsm::payload();
+        }
+        std::lock_guard<std::mutex> lock( mutex );
+        std::map< fsm::args, unsigned >::iterator found = ids.find( args );
+        if( found == ids.end() ) {
+            pool.push_back( fsm::payload(args) );
+            pool.back().id = unsigned( pool.size() - 1 );
+            found = ids.insert( std::make_pair( args, pool.back().id ) ).first;
+        }
+        return pool[ found->second ];
+    }
+
+    // hashed names: "defending"_state is a compile-time id for names that do not fit a fourcc literal.
+    // ids are 31-bit fnv-1a hashes mapped to negative ints, so they never clash with fourccs or enums.
+    // [note] literals are plain ints: they keep no string and are never checked against each other at runtime.
+    //        - collisions are caught by static_assert( fsm::distinct(...) ) over the ids of a definition, or by
+    //          fsm::name() (debug builds, process-wide). definitions themselves are not checked at promote/freeze
+    //          time: two names that collide are the same key there.
+    //        - only fsm::name() fills the debug reverse name table; states built from literals print as numbers
+    //          unless their name was also passed to fsm::name() once, ie: fsm::name( "defending" ).
+    constexpr int hash( const char *str, unsigned h = 2166136261u ) {
+        return *str ? hash( str + 1, (h ^ (unsigned char)(*str)) * 16777619u ) : -1 - int( h & 0x7fffffffu );
+    }
+
+    inline namespace literals {
+        constexpr int operator"" _state( const char *str, size_t ) {
+            return fsm::hash( str );
+        }
+        constexpr int operator"" _trigger( const char *str, size_t ) {
+            return fsm::hash( str );
+        }
+    }
+
+    // compile-time collision check, ie: static_assert( fsm::distinct( "walking"_state, "defending"_state ), "" );
+    constexpr bool distinct_from( int ) {
+        return true;
+    }
+    template<typename... ids>
+    constexpr bool distinct_from( int id, int first, ids... rest ) {
+        return id != first && distinct_from( id, rest... );
+    }
+    constexpr bool distinct() {
+        return true;
+    }
+    template<typename... ids>
+    constexpr bool distinct( int first, ids... rest ) {
+        return distinct_from( first, rest... ) && distinct( rest... );
+    }
+
+    // runtime counterpart of _state, and the only way into the reverse name table: debug builds record every name
+    // passed here (used when printing states) and assert that no two of them hash to the same id. release builds
+    // keep no strings at all.
+#ifndef NDEBUG
+    inline std::map< int, std::string > &names() {
+        static std::map< int, std::string > table;
+        return table;
+    }
+    inline int name( const std::string &str ) {
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock( mutex );
+        int id = fsm::hash( str.c_str() );
+        std::string &known = names()[ id ];
+        assert( (known.empty() || known == str) && "fsm: hashed name collision" );
+        known = str;
+        return id;
+    }
+#else
+    inline int name( const std::string &str ) {
+        return fsm::hash( str.c_str() );
+    }
+#endif
+
+    // trigger families (input.*, damage.*...): a bitmask carried by triggers, matched by stack::on(state,category)
+    struct category {
+        unsigned mask;
+        explicit category( unsigned mask ) : mask(mask)
+        {}
+    };
 
     struct state {
         int name;
-        fsm::args args;
+        unsigned categories;
+        fsm::payload args;
 
-        state( const int &name = 'null' ) : name(name)
+        state( const int &name = 'null', unsigned categories = 0 ) : name(name), categories(categories)
         {}
 
         state operator()() const {
             state self = *this;
-            self.args = {};
+            self.args = fsm::payload();
             return self;
         }
         template<typename T0>
         state operator()( const T0 &t0 ) const {
             state self = *this;
-            self.args = { fsm::to_string(t0) };
+            self.args = fsm::args { fsm::to_string(t0) };
             return self;
         }
         template<typename T0, typename T1>
         state operator()( const T0 &t0, const T1 &t1 ) const {
             state self = *this;
-            self.args = { fsm::to_string(t0), fsm::to_string(t1) };
+            self.args = fsm::args { fsm::to_string(t0), fsm::to_string(t1) };
+            return self;
+        }
+
+        // same state, with its args deduplicated through fsm::intern()
+        state interned() const {
+            state self = *this;
+            if( !args.id ) {
+                self.args = fsm::intern( args );
+            }
             return self;
         }
 
@@ -79,6 +258,12 @@ namespace fsm
 
         template<typename ostream>
         inline friend ostream &operator<<( ostream &out, const state &t ) {
+#ifndef NDEBUG
+            std::map< int, std::string >::const_iterator found = fsm::names().find( t.name );
+            if( found != fsm::names().end() ) {
+                out << found->second;
+            } else
+#endif
             if( t.name >= 256 ) {
                 out << char((t.name >> 24) & 0xff);
                 out << char((t.name >> 16) & 0xff);
@@ -99,6 +284,46 @@ namespace fsm
     };
 
     typedef state trigger;
+    typedef std::vector<bool> bitmap;
+
+    // splitmix64 finalizer
+    inline uint64_t mix( uint64_t h ) {
+        h += 0x9E3779B97F4A7C15ull;
+        h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+        h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBull;
+        return h ^ ( h >> 31 );
+    }
+
+    // stack checksums: every level contributes zobrist( level, state ) and the contributions are xor-ed, so names,
+    // args and positions all count. stable across runs and platforms (args are hashed by content, not by address)
+    inline uint64_t zobrist( size_t level, const fsm::state &s ) {
+        uint64_t h = 14695981039346656037ull;
+        for( const std::string &arg : s.args ) {
+            h = ( h ^ arg.size() ) * 1099511628211ull;
+            for( unsigned char c : arg ) {
+                h = ( h ^ c ) * 1099511628211ull;
+            }
+        }
+        return fsm::mix( h ^ ( ( uint64_t(uint32_t(s.name)) << 32 ) | uint32_t(level) ) );
+    }
+    template<typename iterator>
+    inline uint64_t checksum( iterator begin, iterator end ) {
+        uint64_t h = 0;
+        for( size_t level = 0; begin != end; ++begin, ++level ) {
+            h ^= fsm::zobrist( level, *begin );
+        }
+        return h;
+    }
+
+    // plain per-machine counters: a machine is only ever driven by one thread at a time
+    struct counters {
+        uint64_t commands = 0, handled = 0, calls = 0, changes = 0;
+    };
+
+    struct rule {
+        fsm::state from, trigger;
+        fsm::call fn;
+    };
 
     struct transition {
         fsm::state previous, trigger, current;
@@ -110,11 +335,423 @@ namespace fsm
         }
     };
 
+    class stack;
+    class jit;
+    class population;
+
+    // intrusive transition observer: derive from it and register with stack::observe(). the list nodes live inside
+    // the observers themselves, so (un)registering and notifying never allocate. observers detach on destruction.
+    class observer {
+    public:
+
+        observer()
+        {}
+
+        // an observer is a node of one machine's list: copies would share (and corrupt) its links
+        observer( const observer & ) = delete;
+        observer &operator=( const observer & ) = delete;
+
+        virtual ~observer() {
+            detach();
+        }
+
+        // same transition the stack log records, right before its handler runs
+        virtual void notify( const fsm::stack &machine, const fsm::transition &t ) = 0;
+
+        inline void detach();
+
+    protected:
+
+        friend class stack;
+        fsm::stack *owner = 0;
+        observer *prev = 0, *next = 0;
+    };
+
+    // metrics in OpenMetrics text format: transitions per (state,trigger), entries and dwell time histograms per state,
+    // plus user gauges (ie, queue depths). the hot path only touches counters owned by the calling thread (plain
+    // loads and stores, no atomic read-modify-write); render() merges every thread's counters lazily, at scrape time.
+    class metrics {
+    public:
+
+        static metrics &global() {
+            static metrics instance;
+            return instance;
+        }
+
+        void enable( bool on = true ) {
+            active.store( on, std::memory_order_relaxed );
+        }
+        bool enabled() const {
+            return active.load( std::memory_order_relaxed );
+        }
+
+        // gauge evaluated at scrape time, exported as fsm_queue_depth{queue="name"}
+        void gauge( const std::string &queue, const std::function< double() > &fn ) {
+            std::lock_guard<std::mutex> lock( mutex );
+            gauges[ queue ] = fn;
+        }
+
+        // hot path
+        void transition( int state, int trigger ) {
+            bump( cell( &shard::transitions, ( uint64_t(uint32_t(state)) << 32 ) | uint32_t(trigger) ).count );
+        }
+        void entered( int state, uint64_t times = 1 ) {
+            bump( cell( &shard::states, state ).count, times );
+        }
+        void dwell( int state, uint64_t ns ) {
+            counter &c = cell( &shard::states, state );
+            unsigned bucket = 0;
+            for( uint64_t le = 1000; bucket < buckets && ns > le; le *= 10 ) {
+                ++bucket;
+            }
+            bump( c.hist[bucket] );
+            c.sum.store( c.sum.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+        }
+
+        // steady clock, in ns, used for dwell times
+        static uint64_t now() {
+            return (uint64_t)std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+        }
+
+        // scrape
+        void render( std::ostream &out ) const {
+            std::map< uint64_t, uint64_t > transitions;
+            std::map< int, std::vector<uint64_t> > states; // entries, hist[buckets+1], sum
+            std::map< std::string, std::function< double() > > snapshot;
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                for( auto &sh : shards ) {
+                    std::lock_guard<std::mutex> guard( sh->mutex );
+                    for( auto &kv : sh->transitions ) {
+                        transitions[ kv.first ] += kv.second.count.load( std::memory_order_relaxed );
+                    }
+                    for( auto &kv : sh->states ) {
+                        std::vector<uint64_t> &h = states[ kv.first ];
+                        h.resize( buckets + 3 );
+                        h[0] += kv.second.count.load( std::memory_order_relaxed );
+                        for( unsigned b = 0; b <= buckets; ++b ) {
+                            h[b + 1] += kv.second.hist[b].load( std::memory_order_relaxed );
+                        }
+                        h[buckets + 2] += kv.second.sum.load( std::memory_order_relaxed );
+                    }
+                }
+                snapshot = gauges;
+            }
+            out << "# TYPE fsm_transitions counter\n";
+            for( auto &kv : transitions ) {
+                out << "fsm_transitions_total{state=\"" << label( int(kv.first >> 32) ) << "\",trigger=\"" << label( int(kv.first) ) << "\"} " << kv.second << "\n";
+            }
+            out << "# TYPE fsm_state_entries counter\n";
+            for( auto &kv : states ) {
+                out << "fsm_state_entries_total{state=\"" << label( kv.first ) << "\"} " << kv.second[0] << "\n";
+            }
+            out << "# TYPE fsm_state_dwell_seconds histogram\n";
+            for( auto &kv : states ) {
+                std::string state = label( kv.first );
+                uint64_t total = 0;
+                double le = 1e-6;
+                for( unsigned b = 0; b <= buckets; ++b, le *= 10 ) {
+                    total += kv.second[b + 1];
+                    out << "fsm_state_dwell_seconds_bucket{state=\"" << state << "\",le=\"";
+                    if( b < buckets ) out << le; else out << "+Inf";
+                    out << "\"} " << total << "\n";
+                }
+                out << "fsm_state_dwell_seconds_sum{state=\"" << state << "\"} " << kv.second[buckets + 2] / 1e9 << "\n";
+                out << "fsm_state_dwell_seconds_count{state=\"" << state << "\"} " << total << "\n";
+            }
+            out << "# TYPE fsm_queue_depth gauge\n";
+            for( auto &kv : snapshot ) {
+                out << "fsm_queue_depth{queue=\"" << escape( kv.first ) << "\"} " << kv.second() << "\n";
+            }
+            out << "# EOF\n";
+        }
+
+        // scrape into a file (replaced atomically, for node-exporter style textfile collectors)
+        bool render( const std::string &path ) const {
+            std::stringstream ss;
+            render( ss );
+            std::string data = ss.str(), tmp = path + ".tmp";
+            std::FILE *fp = std::fopen( tmp.c_str(), "wb" );
+            if( !fp ) {
+                return false;
+            }
+            bool ok = std::fwrite( data.data(), 1, data.size(), fp ) == data.size();
+            ok = std::fclose( fp ) == 0 && ok;
+            return ok && std::rename( tmp.c_str(), path.c_str() ) == 0;
+        }
+
+    protected:
+
+        enum { buckets = 9 }; // 1us .. 100s, plus +Inf
+
+        struct counter {
+            std::atomic<uint64_t> count, sum, hist[ buckets + 1 ];
+            counter() : count(0), sum(0) {
+                for( auto &h : hist ) h.store( 0, std::memory_order_relaxed );
+            }
+        };
+        struct shard {
+            std::mutex mutex; // only held when a new key is inserted, or while scraping
+            std::map< uint64_t, counter > transitions; // (state,trigger) -> calls
+            std::map< int, counter > states;           // state -> entries, dwell histogram
+        };
+
+        metrics() : active(false)
+        {}
+
+        // single writer per shard: a relaxed load + store compiles to a plain increment
+        static void bump( std::atomic<uint64_t> &c, uint64_t times = 1 ) {
+            c.store( c.load( std::memory_order_relaxed ) + times, std::memory_order_relaxed );
+        }
+        shard &local() {
+            static thread_local shard *mine = 0;
+            if( !mine ) {
+                std::lock_guard<std::mutex> lock( mutex );
+                shards.push_back( std::unique_ptr<shard>( new shard ) ); // outlives the thread: counters are totals
+                mine = shards.back().get();
+            }
+            return *mine;
+        }
+        template<typename K>
+        counter &cell( std::map< K, counter > shard::*table, K k ) {
+            shard &mine = local();
+            std::map< K, counter > &cells = mine.*table;
+            typename std::map< K, counter >::iterator found = cells.find( k );
+            if( found == cells.end() ) {
+                std::lock_guard<std::mutex> lock( mine.mutex );
+                found = cells.emplace( std::piecewise_construct, std::forward_as_tuple(k), std::forward_as_tuple() ).first;
+            }
+            return found->second;
+        }
+
+        // label values are text: control bytes are dropped
+        static std::string escape( const std::string &str ) {
+            std::string out;
+            for( char ch : str ) {
+                unsigned char byte = (unsigned char)ch;
+                /**/ if( ch == '\n' ) out += "\\n";
+                else if( byte < 0x20 || byte == 0x7f ) continue;
+                else if( ch == '\\' || ch == '"' ) out += '\\', out += ch;
+                else out += ch;
+            }
+            return out;
+        }
+        // a state is labelled by its fourcc (short ones such as 'go' without their leading zero bytes) or debug name.
+        // anything else (non-ascii bytes, numeric ids) is labelled "#<id>": dropping bytes would merge series, and
+        // a bare number could read as a fourcc such as '1024'
+        static std::string label( int name ) {
+            std::stringstream ss;
+            ss << fsm::state( name );
+            std::string str = ss.str(), id = std::to_string( name );
+            str = str.substr( 0, str.size() - 2 ); // drop "()"
+            str.erase( 0, str.find_first_not_of( '\0' ) );
+            bool printable = str != id;
+            for( char ch : str ) {
+                printable = printable && (unsigned char)ch >= 0x20 && (unsigned char)ch < 0x7f;
+            }
+            return printable ? escape( str ) : "#" + id;
+        }
+
+        std::atomic<bool> active;
+        mutable std::mutex mutex;
+        std::vector< std::unique_ptr<shard> > shards;
+        std::map< std::string, std::function< double() > > gauges;
+    };
+
+    // change stream: text records of stack changes, buffered by append() and written in batches by commit().
+    // it writes to any FILE* (file, pipe, fdopen'd unix socket); replay() rebuilds the machines on the reading side
+    // without invoking handlers. record: seq id op level name nargs (len arg)*
+    class changelog {
+    public:
+
+        explicit changelog( std::FILE *fp = 0, size_t batch = 0 ) : fp(fp), batch(batch), seq(0), pending(0), batches(0)
+        {}
+
+        // machines still streaming here are detached first (see stack::detach), so they may outlive their log
+        virtual ~changelog();
+
+        // false without a file, or while the last commit failed (its records are kept for the next one)
+        bool good() const {
+            return fp != 0 && !failed;
+        }
+
+        // last sequence number appended, and number of batches written. follower lag = sequence() - last replayed seq
+        size_t sequence() const {
+            return seq;
+        }
+        size_t commits() const {
+            return batches;
+        }
+
+        void append( unsigned id, int op, size_t level, const fsm::state &next ) {
+            buffer << ++seq << ' ';
+            write( buffer, id, op, level, next );
+            if( ++pending >= batch && batch ) {
+                commit();
+            }
+        }
+
+        // write every pending record as a single batch. returns number of records written; 0 if the write failed,
+        // in which case the records stay buffered and the next commit retries them
+        size_t commit() {
+            if( !fp ) {
+                buffer.str( std::string() );
+                pending = 0;
+                return 0;
+            }
+            if( !pending ) {
+                return 0;
+            }
+            // whatever fwrite() did not take stays in the buffer, so a retry never writes a record twice
+            std::string data = buffer.str();
+            size_t written = std::fwrite( data.data(), 1, data.size(), fp );
+            buffer.str( data.substr( written ) );
+            buffer.seekp( 0, std::ios::end );
+            failed = written != data.size() || !sync();
+            if( failed ) {
+                return 0;
+            }
+            size_t done = pending;
+            pending = 0;
+            ++batches;
+            return done;
+        }
+
+        // apply records read from `in` until end of stream or a torn record, skipping seq <= after.
+        // lookup(id) returns the machine for a record (or null to skip it). `valid` receives the offset right after
+        // the last whole record. returns records applied
+        template<typename function>
+        static size_t replay( std::FILE *in, const function &lookup, size_t after = 0, size_t *last = 0, long *valid = 0 );
+
+    protected:
+
+        static void write( std::ostream &out, unsigned id, int op, size_t level, const fsm::state &next ) {
+            out << id << ' ' << op << ' ' << level << ' ' << next.name << ' ' << next.args.size();
+            for( auto &arg : next.args ) {
+                out << ' ' << arg.size() << ' ' << arg;
+            }
+            out << '\n';
+        }
+
+        // how far a commit goes: the OS for a changelog, the disk for a wal
+        virtual bool sync() {
+            return std::fflush( fp ) == 0;
+        }
+
+        std::FILE *fp;
+        std::stringstream buffer;
+        size_t batch, seq, pending, batches;
+        bool failed = false;
+        std::vector< fsm::stack * > machines;
+        friend class fsm::stack;
+    };
+
+    // write-ahead log for durable machines. commit() is a group commit: many machines pay for a single fsync.
+    // recover() rebuilds stacks from the last checkpoint plus the log.
+    class wal : public changelog {
+    public:
+
+        // commit() is a group commit here: every pending record is written and fsync'ed once, and the records it
+        // reports are durable
+        explicit wal( const std::string &path, size_t batch = 0 ) : changelog( 0, batch ), path(path) {
+            // a crash may have left a torn record at the tail. it is cut off first: otherwise the next record would be
+            // glued to it, and recover() would stop there and lose everything appended afterwards
+            if( repair( path ) ) {
+                fp = std::fopen( path.c_str(), "ab" );
+            }
+            // carry on numbering after whatever checkpoint and log are already on disk
+            recover( path, [&]( unsigned ) -> fsm::stack * { return 0; }, &seq );
+        }
+
+        ~wal() {
+            if( fp ) {
+                commit();
+                std::fclose( fp );
+                fp = 0;
+            }
+        }
+
+        // snapshot every machine logging here into `path`.ckpt, then start an empty log
+        bool checkpoint();
+        // same, once [begin,end) of fsm::stack * is known to hold every machine logging here. otherwise the log is the
+        // only record of the machines left out, so nothing is written and false is returned
+        template<typename iterator>
+        bool checkpoint( iterator begin, iterator end );
+
+        // replay checkpoint + log without invoking handlers. a torn record at the tail (crash during write)
+        // ends the replay. returns records applied
+        template<typename function>
+        static size_t recover( const std::string &path, const function &lookup, size_t *last_seq = 0 ) {
+            size_t applied = 0, ckpt_seq = 0, last = 0;
+            if( std::FILE *ckpt = std::fopen( (path + ".ckpt").c_str(), "rb" ) ) {
+                if( std::fscanf( ckpt, "%zu", &ckpt_seq ) == 1 ) {
+                    applied += replay( ckpt, lookup, 0, &last );
+                }
+                std::fclose( ckpt );
+            }
+            if( std::FILE *log = std::fopen( path.c_str(), "rb" ) ) {
+                applied += replay( log, lookup, ckpt_seq, &last );
+                std::fclose( log );
+            }
+            if( last_seq ) {
+                *last_seq = (std::max)( last, ckpt_seq );
+            }
+            return applied;
+        }
+
+    protected:
+
+        // cut `path` back to its last whole record, through a temporary file as checkpoints do
+        static bool repair( const std::string &path ) {
+            std::FILE *in = std::fopen( path.c_str(), "rb" );
+            if( !in ) {
+                return true;
+            }
+            long valid = 0, size = -1;
+            replay( in, []( unsigned ) -> fsm::stack * { return 0; }, 0, 0, &valid );
+            if( std::fseek( in, 0, SEEK_END ) == 0 ) {
+                size = std::ftell( in );
+            }
+            if( size == valid ) {
+                std::fclose( in );
+                return true;
+            }
+            std::string data( size_t(valid), '\0' );
+            bool ok = size > valid && std::fseek( in, 0, SEEK_SET ) == 0 &&
+                ( !valid || std::fread( &data[0], 1, data.size(), in ) == data.size() );
+            std::fclose( in );
+            std::string tmp = path + ".tmp";
+            std::FILE *out = ok ? std::fopen( tmp.c_str(), "wb" ) : 0;
+            if( !out ) {
+                return false;
+            }
+            ok = std::fwrite( data.data(), 1, data.size(), out ) == data.size() && sync( out );
+            std::fclose( out );
+            return ok && std::rename( tmp.c_str(), path.c_str() ) == 0;
+        }
+
+        bool sync() {
+            return sync( fp );
+        }
+        static bool sync( std::FILE *fp ) {
+            if( std::fflush( fp ) != 0 ) {
+                return false;
+            }
+#ifdef _WIN32
+            return _commit( _fileno( fp ) ) == 0;
+#else
+            return fsync( fileno( fp ) ) == 0;
+#endif
+        }
+
+        std::string path;
+    };
+
     class stack {
     public:
 
-        stack( const fsm::state &start = 'null' ) : deque(1) {
-            deque[0] = start;
+        stack( const fsm::state &start = 'null' ) {
+            push_level( start );
             call( deque.back(), 'init' );
         }
 
@@ -122,10 +759,17 @@ namespace fsm
         {}
 
         ~stack() {
+            // durable and replicated machines keep their last state: teardown is not logged
+            while( !sinks.empty() ) {
+                detach( *sinks.back().first );
+            }
             // ensure state destructors are called (w/ 'quit')
             while( size() ) {
                 pop();
             }
+            while( watchers.head ) {
+                watchers.head->detach();
+            }
         }
 
         // pause current state (w/ 'push') and create a new active child (w/ 'init')
@@ -134,8 +778,10 @@ namespace fsm
                 return;
             }
             // queue
-            call( deque.back(), 'push' );
-            deque.push_back( state );
+            if( deque.size() ) {
+                call( deque.back(), 'push' );
+            }
+            push_level( state );
             call( deque.back(), 'init' );
         }
 
@@ -143,7 +789,7 @@ namespace fsm
         void pop() {
             if( deque.size() ) {
                 call( deque.back(), 'quit' );
-                deque.pop_back();
+                pop_level( deque.size() - 1 );
             }
             if( deque.size() ) {
                 call( deque.back(), 'back' );
@@ -153,12 +799,113 @@ namespace fsm
         // set current active state
         void set( const fsm::state &state ) {
             if( deque.size() ) {
-                replace( deque.back(), state );
+                replace( deque.size() - 1, state );
             } else {
                 push(state);
             }
         }
 
+        // undo journal: keep the last `capacity` stack changes (0 disables it) and a keyframe every `interval` changes
+        void journal( size_t capacity, size_t interval = 64 ) {
+            undo = journal_t();
+            undo.capacity = capacity;
+            undo.interval = interval ? interval : 1;
+        }
+
+        // restore the stack as it was `steps` changes ago, without invoking any handler. returns steps rewound
+        size_t rewind( size_t steps ) {
+            steps = (std::min)( steps, undo.changes.size() );
+            size_t target = undo.seq - steps, from = undo.seq;
+            // start from the nearest keyframe at or after the target, if it saves work
+            while( undo.keyframes.size() && undo.keyframes.back().first > undo.seq ) {
+                undo.keyframes.pop_back();
+            }
+            auto key = std::lower_bound( undo.keyframes.begin(), undo.keyframes.end(), target,
+                []( const std::pair< size_t, states > &k, size_t seq ) { return k.first < seq; } );
+            if( key != undo.keyframes.end() && key->first < from ) {
+                deque = key->second;
+                from = key->first;
+            }
+            size_t first = undo.seq - undo.changes.size();
+            for( size_t seq = from; seq-- > target; ) {
+                const change &c = undo.changes[ seq - first ];
+                /**/ if( c.op == 'push' ) deque.erase( deque.begin() + c.level );
+                else if( c.op == 'pop'  ) deque.insert( deque.begin() + c.level, c.previous );
+                else                      deque[ c.level ] = c.previous;
+            }
+            undo.changes.erase( undo.changes.end() - steps, undo.changes.end() );
+            undo.seq = target;
+            while( undo.keyframes.size() && undo.keyframes.back().first > target ) {
+                undo.keyframes.pop_back();
+            }
+            digest = fsm::checksum( deque.begin(), deque.end() );
+            // sinks only know changes: they get the rewound stack as a snapshot
+            for( auto &sink : sinks ) {
+                snapshot( sink );
+            }
+            return steps;
+        }
+
+        // transition observers; a machine without observers only pays a null check
+        void observe( fsm::observer &o ) {
+            o.detach();
+            o.owner = this;
+            o.next = watchers.head;
+            if( watchers.head ) {
+                watchers.head->prev = &o;
+            }
+            watchers.head = &o;
+        }
+
+        // durable machine: log every change to `log` as machine `id`, starting with a snapshot of the current stack
+        void durable( fsm::wal &log, unsigned id ) {
+            replicate( log, id );
+        }
+
+        // stream every change to `log` as machine `id` (ie, to a follower process), starting with a snapshot
+        void replicate( fsm::changelog &log, unsigned id ) {
+            sinks.owner = this;
+            sinks.push_back( std::make_pair( &log, id ) );
+            log.machines.push_back( this );
+            snapshot( sinks.back() );
+        }
+        // stop streaming changes to `log`, under every id it had here
+        void detach( fsm::changelog &log ) {
+            sinks.erase( std::remove_if( sinks.begin(), sinks.end(), [&]( const sink &s ) { return s.first == &log; } ), sinks.end() );
+            log.machines.erase( std::remove( log.machines.begin(), log.machines.end(), this ), log.machines.end() );
+        }
+
+        // apply a recorded change ('push', 'pop', 'set' or 'clr') without invoking any handler
+        void apply( int op, size_t level, const fsm::state &next ) {
+            /**/ if( op == 'push' && level <= deque.size() ) {
+                while( deque.size() > level ) pop_level( deque.size() - 1 );
+                push_level( next );
+            }
+            else if( op == 'pop'  && level < deque.size() ) pop_level( level );
+            else if( op == 'set'  && level < deque.size() ) set_level( level, next );
+            else if( op == 'clr' ) while( deque.size() ) pop_level( deque.size() - 1 );
+        }
+
+        // replace the whole stack with [begin,end) at once, without invoking any handler nor recording the change.
+        // the undo journal restarts from here. populations load and store their machines through this
+        template<typename iterator>
+        void assign( iterator begin, iterator end ) {
+            assign( begin, end, fsm::checksum( begin, end ) );
+        }
+        // same, when the hash of [begin,end) is already known (ie, kept by a population)
+        template<typename iterator>
+        void assign( iterator begin, iterator end, uint64_t hash ) {
+            deque.assign( begin, end );
+            digest = hash;
+            since.clear();
+            if( undo.capacity ) {
+                journal( undo.capacity, undo.interval );
+            }
+            for( auto &sink : sinks ) {
+                snapshot( sink );
+            }
+        }
+
         // number of children (stack)
         size_t size() const {
             return deque.size();
@@ -175,6 +922,13 @@ namespace fsm
             signed size = (signed)(log.size());
             return size ? *( log.begin() + (pos >= 0 ? pos % size : size - 1 + ((pos+1) % size) ) ) : fsm::transition();
         }
+        const fsm::counters &get_counters() const {
+            return stats;
+        }
+        // 64-bit hash of the whole stack (see fsm::checksum), kept up to date on every change
+        uint64_t hash() const {
+            return digest;
+        }
         std::string get_trigger() const {
             std::stringstream ss;
             return ss << current_trigger, ss.str();
@@ -184,6 +938,23 @@ namespace fsm
             return deque.empty() ? false : ( deque.back() == state );
         }
 
+        // whether some handler (exact, repeat or category) takes `to` while in `from`
+        bool handles( const fsm::state &from, const fsm::state &to ) const {
+            return find( from, to ) || find_repeat( from, to );
+        }
+        // whether any state has an exact handler for `to` (ie, lifecycle triggers such as 'init' or 'quit')
+        bool handles( const fsm::state &to ) const {
+            const table *tables[] = { &callbacks, &repeats };
+            for( const table *t : tables ) {
+                for( const entry &e : *t ) {
+                    if( e.first.second == to.name ) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
         /* (idle)___(trigger)__/''(hold)''''(release)''\__
         bool is_idle()      const { return transition.previous == transition.current; }
         bool is_triggered() const { return transition.previous == transition.current; }
@@ -191,59 +962,178 @@ namespace fsm
         bool is_released()  const { return transition.previous == transition.current; } */
 
         // setup
+        // [note] handlers live in a definition-owned deque in registration order (chunks of neighbouring handlers,
+        //        not one contiguous block: references returned by on() stay valid while more handlers are added, even
+        //        from a running handler). captures beyond std::function's small buffer are still heap allocated.
+        //        the table sorted by (state,trigger) only keeps offsets into the deque. on() looks the key up in the
+        //        sorted part and appends new keys to an unsorted tail, so registering in any order is O(log n); the
+        //        first lookup afterwards sorts the tail and merges it in once (see bench.cc). a key registered twice
+        //        before that gets two handlers and the last one wins, as with the bulk on() below.
         fsm::call &on( const fsm::state &from, const fsm::state &to ) {
-            return callbacks[ bistate(from,to) ];
+            bistate key( from, to );
+            table::iterator sorted = callbacks.begin() + settled;
+            table::iterator found = std::lower_bound( callbacks.begin(), sorted, key, by_key() );
+            if( found != sorted && found->first == key ) {
+                return handlers[ found->second ];
+            }
+            callbacks.push_back( entry( key, unsigned(handlers.size()) ) );
+            handlers.emplace_back();
+            demote();
+            return handlers.back();
         }
 
-        // generic call
-        bool call( const fsm::state &from, const fsm::state &to ) const {
-            std::map< bistate, fsm::call >::const_iterator found = callbacks.find(bistate(from,to));
-            if( found != callbacks.end() ) {
-                log.push_back( { from, current_trigger, to } );
-                if( log.size() > 50 ) {
-                    log.pop_front();
-                }
-                found->second( to.args );
-                return true;
+        // repeat setup: handler for many repetitions of (state,trigger) at once. takes precedence over on(state,trigger)
+        fsm::repeat_call &on_repeat( const fsm::state &from, const fsm::state &to ) {
+            bistate key( from, to );
+            table::iterator found = std::lower_bound( repeats.begin(), repeats.end(), key, by_key() );
+            if( found == repeats.end() || found->first != key ) {
+                found = repeats.insert( found, entry( key, unsigned(repeat_handlers.size()) ) );
+                repeat_handlers.emplace_back();
             }
-            return false;
+            return repeat_handlers[ found->second ];
         }
 
-        // user commands
-        bool command( const fsm::state &trigger ) {
-            size_t size = this->size();
-            if( !size ) {
-                return false;
+        // category setup: handles every trigger of `from` that has no exact handler and shares a bit with c.mask
+        fsm::call &on( const fsm::state &from, fsm::category c ) {
+            family key( from.name, c.mask );
+            std::vector< std::pair< family, unsigned > >::iterator found =
+                std::lower_bound( families.begin(), families.end(), std::make_pair( key, 0u ) );
+            if( found == families.end() || found->first != key ) {
+                found = families.insert( found, std::make_pair( key, unsigned(handlers.size()) ) );
+                handlers.emplace_back();
             }
-            current_trigger = fsm::state();
-            std::deque< states::reverse_iterator > aborted;
-            for( auto it = deque.rbegin(); it != deque.rend(); ++it ) {
-                fsm::state &self = *it;
-                if( !call(self,trigger) ) {
-                    aborted.push_back(it);
+            return handlers[ found->second ];
+        }
+
+        // bulk setup: rules are sorted once, their handlers appended in key order and merged into the table
+        void on( std::initializer_list<fsm::rule> rules ) {
+            on( rules.begin(), rules.end() );
+        }
+        void on( const std::vector<fsm::rule> &rules ) {
+            on( rules.data(), rules.data() + rules.size() );
+        }
+        void on( const fsm::rule *begin, const fsm::rule *end ) {
+            settle();
+            std::vector< std::pair<bistate, size_t> > sorted;
+            sorted.reserve( end - begin );
+            for( const fsm::rule *r = begin; r != end; ++r ) {
+                sorted.push_back( std::make_pair( bistate(r->from, r->trigger), size_t(r - begin) ) );
+            }
+            std::sort( sorted.begin(), sorted.end() );
+            size_t registered = callbacks.size();
+            callbacks.reserve( registered + sorted.size() );
+            for( size_t i = 0, n = sorted.size(); i < n; ++i ) {
+                // duplicated keys are adjacent and in registration order: last one wins, as with on(from,to) = fn
+                if( i + 1 < n && sorted[i + 1].first == sorted[i].first ) {
                     continue;
                 }
-                for( auto it = aborted.begin(), end = aborted.end(); it != end; ++it ) {
-                    call(**it, 'quit');
-                    deque.erase(--(it->base()));
+                const fsm::call &fn = begin[ sorted[i].second ].fn;
+                table::iterator found = std::lower_bound( callbacks.begin(), callbacks.begin() + registered, sorted[i].first, by_key() );
+                if( found != callbacks.begin() + registered && found->first == sorted[i].first ) {
+                    handlers[ found->second ] = fn;
+                    continue;
                 }
-                current_trigger = trigger;
-                return true;
+                callbacks.push_back( entry( sorted[i].first, unsigned(handlers.size()) ) );
+                handlers.push_back( fn );
+            }
+            std::inplace_merge( callbacks.begin(), callbacks.begin() + registered, callbacks.end(), by_key() );
+            settled = callbacks.size();
+            if( callbacks.size() != registered ) {
+                demote();
             }
-            return false;
         }
-        template<typename T>
-        bool command( const fsm::state &trigger, const T &arg1 ) {
-            return command( trigger(arg1) );
+
+        // tiered execution: lookups start on the sorted table; once `threshold` commands were dispatched since the
+        // last new transition, a flat hash table is built in the background and swapped in atomically. registering
+        // a new transition goes back to the sorted table. threshold 0 disables promotion
+        void tiering( size_t threshold ) {
+            tier.threshold = threshold;
+            tier.due = stats.commands + threshold;
         }
-        template<typename T, typename U>
-        bool command( const fsm::state &trigger, const T &arg1, const U &arg2 ) {
-            return command( trigger(arg1, arg2) );
+        // build the flat table now, in this thread (ie, definitions known to be hot at startup)
+        void promote() {
+            settle();
+            compiling()->build( callbacks );
+        }
+        bool promoted() const {
+            return tier.slot && tier.slot->published.load( std::memory_order_acquire );
+        }
+
+        // generic call
+        bool call( const fsm::state &from, const fsm::state &to ) const {
+            const fsm::call *found = find( from, to );
+            if( found ) {
+                invoke( *found, from, to );
+                return true;
+            }
+            return false;
+        }
+
+        // intern the args of every command handled by this definition (see fsm::intern), so machines that keep
+        // sending the same few values share their strings. off by default
+        void interning( bool on ) {
+            interns = on;
+        }
+
+        // user commands
+        bool command( const fsm::state &trigger ) {
+            if( interns && !trigger.args.empty() ) {
+                return dispatch( trigger, [&]() { return trigger.interned(); } ) != 0;
+            }
+            return dispatch( trigger, [&]() -> const fsm::state & { return trigger; } ) != 0;
+        }
+        // args are only built once some level is known to handle the trigger; rejected commands format nothing
+        template<typename T>
+        bool command( const fsm::state &trigger, const T &arg1 ) {
+            return dispatch( trigger, [&]() { return interns ? trigger(arg1).interned() : trigger(arg1); } ) != 0;
+        }
+        template<typename T, typename U>
+        bool command( const fsm::state &trigger, const T &arg1, const U &arg2 ) {
+            return dispatch( trigger, [&]() { return interns ? trigger(arg1, arg2).interned() : trigger(arg1, arg2); } ) != 0;
+        }
+        // deliver n repetitions of trigger. repeat handlers (see on_repeat) take as many as they can in one call;
+        // whatever they leave is dispatched again from the resulting state. returns repetitions handled
+        size_t command( const fsm::state &trigger, fsm::repeat n ) {
+            if( interns && !trigger.args.empty() && !trigger.args.id ) {
+                return command( trigger.interned(), n );
+            }
+            size_t done = 0;
+            while( done < n.count ) {
+                size_t consumed = dispatch( trigger, [&]() -> const fsm::state & { return trigger; }, n.count - done );
+                if( !consumed ) {
+                    break;
+                }
+                done += consumed;
+            }
+            return done;
+        }
+
+        // batch commands: one handled bit per trigger, in order, same as a loop of command(). the command counter and
+        // the tier promotion check are settled once for the whole batch
+        template<typename iterator>
+        fsm::bitmap command_batch( iterator begin, iterator end ) {
+            size_t count = std::distance(begin, end);
+            fsm::bitmap handled;
+            handled.reserve( count );
+            counted( count );
+            for( ; begin != end; ++begin ) {
+                const fsm::state &trigger = *begin;
+                current_trigger = fsm::state();
+                if( interns && !trigger.args.empty() ) {
+                    handled.push_back( handle( trigger, [&]() { return trigger.interned(); } ) != 0 );
+                } else {
+                    handled.push_back( handle( trigger, [&]() -> const fsm::state & { return trigger; } ) != 0 );
+                }
+            }
+            return handled;
+        }
+        fsm::bitmap command_batch( const fsm::state *triggers, size_t count ) {
+            return command_batch( triggers, triggers + count );
         }
 
         // debug
         template<typename ostream>
-        ostream &debug( ostream &out ) {
+        ostream &debug( ostream &out ) const {
             int total = log.size();
             out << "status {" << std::endl;
             std::string sep = "\t";
@@ -266,11 +1156,11 @@ namespace fsm
         }
         template<typename T>
         bool operator()( const fsm::state &trigger, const T &arg1 ) {
-            return command( trigger(arg1) );
+            return command( trigger, arg1 );
         }
         template<typename T, typename U>
         bool operator()( const fsm::state &trigger, const T &arg1, const U &arg2 ) {
-            return command( trigger(arg1, arg2) );
+            return command( trigger, arg1, arg2 );
         }
         template<typename ostream>
         inline friend ostream &operator<<( ostream &out, const stack &t ) {
@@ -279,21 +1169,1349 @@ namespace fsm
 
     protected:
 
-        void replace( fsm::state &current, const fsm::state &next ) {
-            call( current, 'quit' );
-            current = next;
-            call( current, 'init' );
+        void replace( size_t level, const fsm::state &next ) {
+            call( deque[level], 'quit' );
+            set_level( level, next );
+            call( deque[level], 'init' );
+        }
+
+        // every change to the stack goes through these three, so journals see each change exactly once
+        void push_level( const fsm::state &next ) {
+            changing( 'push', deque.size(), next );
+            deque.push_back( next );
+        }
+        void pop_level( size_t level ) {
+            changing( 'pop', level, fsm::state() );
+            deque.erase( deque.begin() + level );
+        }
+        void set_level( size_t level, const fsm::state &next ) {
+            changing( 'set', level, next );
+            deque[level] = next;
+        }
+        // state entries and dwell times; levels that predate enabling metrics count from their first change
+        void meter( int op, size_t level, const fsm::state &next ) {
+            fsm::metrics &m = fsm::metrics::global();
+            uint64_t now = fsm::metrics::now();
+            since.resize( deque.size(), now );
+            if( op != 'push' ) {
+                m.dwell( deque[level].name, now - since[level] );
+            }
+            /**/ if( op == 'push' ) since.push_back( now );
+            else if( op == 'pop'  ) since.erase( since.begin() + level );
+            else                    since[level] = now;
+            if( op != 'pop' ) {
+                m.entered( next.name );
+            }
+        }
+
+        // whole stack as a 'clr' record followed by one 'push' per level
+        void snapshot( const std::pair< fsm::changelog *, unsigned > &sink ) {
+            sink.first->append( sink.second, 'clr', 0, fsm::state() );
+            for( size_t level = 0; level < deque.size(); ++level ) {
+                sink.first->append( sink.second, 'push', level, deque[level] );
+            }
+        }
+
+        // zobrist update: O(1) at the top of the stack, where nearly every change happens. popping a level from the
+        // middle shifts the levels above it, and those are rehashed
+        void rehash( int op, size_t level, const fsm::state &next ) {
+            /**/ if( op == 'push' ) digest ^= fsm::zobrist( level, next );
+            else if( op == 'set'  ) digest ^= fsm::zobrist( level, deque[level] ) ^ fsm::zobrist( level, next );
+            else {
+                digest ^= fsm::zobrist( level, deque[level] );
+                for( size_t above = level + 1; above < deque.size(); ++above ) {
+                    digest ^= fsm::zobrist( above, deque[above] ) ^ fsm::zobrist( above - 1, deque[above] );
+                }
+            }
+        }
+
+        // called right before the change; deque[level] (if any) is still the previous state
+        void changing( int op, size_t level, const fsm::state &next ) {
+            ++stats.changes;
+            rehash( op, level, next );
+            if( fsm::metrics::global().enabled() ) {
+                meter( op, level, next );
+            }
+            for( auto &sink : sinks ) {
+                sink.first->append( sink.second, op, level, next );
+            }
+            if( undo.capacity ) {
+                if( undo.seq % undo.interval == 0 ) {
+                    undo.keyframes.push_back( std::make_pair( undo.seq, deque ) );
+                }
+                undo.changes.push_back( { op, level, op == 'push' ? fsm::state() : deque[level] } );
+                ++undo.seq;
+                if( undo.changes.size() > undo.capacity ) {
+                    undo.changes.pop_front();
+                }
+                while( undo.keyframes.size() && undo.keyframes.front().first < undo.seq - undo.changes.size() ) {
+                    undo.keyframes.pop_front();
+                }
+            }
         }
 
         typedef std::pair<int, int> bistate;
-        std::map< bistate, fsm::call > callbacks;
+        typedef std::pair<bistate, unsigned> entry;
+        typedef std::vector<entry> table;
+        struct by_key {
+            bool operator()( const entry &a, const entry &b ) const { return a.first < b.first; }
+            bool operator()( const entry &a, const bistate &b ) const { return a.first < b; }
+        };
+        // callbacks[0,settled) is sorted by key; on() appends new keys after it until the next lookup settles them
+        mutable table callbacks;
+        mutable size_t settled = 0;
+        void settle() const {
+            if( settled == callbacks.size() ) {
+                return;
+            }
+            // stable, so the last registration of a duplicated key ends up last in its run and is the one kept
+            std::stable_sort( callbacks.begin() + settled, callbacks.end(), by_key() );
+            table::iterator out = callbacks.begin() + settled;
+            for( table::iterator it = out; it != callbacks.end(); ++it ) {
+                if( it + 1 == callbacks.end() || it[1].first != it->first ) {
+                    *out++ = *it;
+                }
+            }
+            callbacks.erase( out, callbacks.end() );
+            std::inplace_merge( callbacks.begin(), callbacks.begin() + settled, callbacks.end(), by_key() );
+            settled = callbacks.size();
+        }
+        table repeats;
+        std::deque< fsm::repeat_call > repeat_handlers;
+        typedef std::pair<int, unsigned> family;
+        std::vector< std::pair< family, unsigned > > families;
+        std::deque< fsm::call > handlers; // stable addresses: on() hands out references
+
+        template<typename function>
+        void invoke( const function &fn, const fsm::state &from, const fsm::state &to ) const {
+            ++stats.calls;
+            if( fsm::metrics::global().enabled() ) {
+                fsm::metrics::global().transition( from.name, to.name );
+            }
+            log.push_back( { from, current_trigger, to } );
+            if( log.size() > 50 ) {
+                log.pop_front();
+            }
+            if( watchers.head ) {
+                for( fsm::observer *o = watchers.head, *next; o; o = next ) {
+                    next = o->next; // allows observers to detach while being notified
+                    o->notify( *this, log.back() );
+                }
+            }
+            fn( to.args );
+        }
+
+        // count `commands` more commands; crossing the tiering threshold builds the flat table in the background
+        void counted( size_t commands ) {
+            uint64_t before = stats.commands;
+            stats.commands += commands;
+            if( tier.threshold && before < tier.due && tier.due <= stats.commands ) {
+                std::shared_ptr< compiled > slot = compiling();
+                settle();
+                table snapshot = callbacks;
+                std::thread( [slot, snapshot]() { slot->build( snapshot ); } ).detach();
+            }
+        }
+
+        // walk the stack innermost first; make() materialises the full trigger (w/ args) for the handling level only.
+        // up to `count` repetitions are offered to a repeat handler. returns repetitions consumed, 0 if unhandled
+        template<typename materialise>
+        size_t dispatch( const fsm::state &trigger, const materialise &make, size_t count = 1 ) {
+            counted( 1 );
+            current_trigger = fsm::state();
+            return handle( trigger, make, count );
+        }
+        // dispatch() without the per-command bookkeeping
+        template<typename materialise>
+        size_t handle( const fsm::state &trigger, const materialise &make, size_t count = 1 ) {
+            size_t size = this->size();
+            for( size_t level = size; level--; ) {
+                const fsm::repeat_call *many = repeats.empty() ? 0 : find_repeat( deque[level], trigger );
+                const fsm::call *found = many ? 0 : find( deque[level], trigger );
+                if( !many && !found ) {
+                    continue;
+                }
+                const fsm::state &full = make();
+                size_t consumed = 1;
+                if( many ) {
+                    invoke( [&]( const fsm::args &args ) {
+                        consumed = (std::max)( size_t(1), (std::min)( count, (*many)( args, count ) ) );
+                    }, deque[level], full );
+                } else {
+                    invoke( *found, deque[level], full );
+                }
+                // unhandled children above the handler level are aborted (w/ 'quit'), innermost first
+                for( size_t child = size; --child > level; ) {
+                    if( child < deque.size() ) {
+                        call(deque[child], 'quit');
+                        pop_level(child);
+                    }
+                }
+                current_trigger = full;
+                ++stats.handled;
+                return consumed;
+            }
+            return 0;
+        }
+
+        const fsm::repeat_call *find_repeat( const fsm::state &from, const fsm::state &to ) const {
+            bistate key( from, to );
+            table::const_iterator found = std::lower_bound( repeats.begin(), repeats.end(), key, by_key() );
+            return found != repeats.end() && found->first == key ? &repeat_handlers[ found->second ] : 0;
+        }
+
+        const fsm::call *find( const fsm::state &from, const fsm::state &to ) const {
+            bistate key( from, to );
+            const compiled *tiered = tier.slot.get();
+            const compiled::flat *flat = tiered ? tiered->published.load( std::memory_order_acquire ) : 0;
+            if( tiered && tiered->native ) {
+                unsigned found = tiered->native( key.first, key.second );
+                if( found != compiled::empty ) {
+                    return &handlers[ found ];
+                }
+            } else if( flat ) {
+                unsigned found = flat->find( key );
+                if( found != compiled::empty ) {
+                    return &handlers[ found ];
+                }
+            } else {
+                settle();
+                table::const_iterator found = std::lower_bound( callbacks.begin(), callbacks.end(), key, by_key() );
+                if( found != callbacks.end() && found->first == key ) {
+                    return &handlers[ found->second ];
+                }
+            }
+            // exact trigger first, then the category handlers of this state
+            if( to.categories && families.size() ) {
+                std::vector< std::pair< family, unsigned > >::const_iterator it =
+                    std::lower_bound( families.begin(), families.end(), std::make_pair( family( from.name, 0u ), 0u ) );
+                for( ; it != families.end() && it->first.first == from.name; ++it ) {
+                    if( it->first.second & to.categories ) {
+                        return &handlers[ it->second ];
+                    }
+                }
+            }
+            return 0;
+        }
 
         mutable std::deque< fsm::transition > log;
         std::deque< fsm::state > deque;
         fsm::state current_trigger;
+        bool interns = false;
 
         typedef std::deque< fsm::state > states;
+
+        struct change {
+            int op;
+            size_t level;
+            fsm::state previous;
+        };
+        struct journal_t {
+            size_t capacity = 0, interval = 64, seq = 0;
+            std::deque< change > changes;
+            std::deque< std::pair< size_t, states > > keyframes;
+        } undo;
+
+        // compiled tier: open addressing over (state,trigger) at most half full, slots hold handler offsets.
+        // a table is published once and never replaced while its slot lives; a late build for a stale
+        // definition lands in a slot the stack already dropped
+        struct compiled {
+            enum : unsigned { empty = ~0u };
+            struct flat {
+                std::vector< entry > slots;
+                unsigned shift;
+                size_t at( const bistate &key ) const {
+                    uint64_t k = ( uint64_t(uint32_t(key.first)) << 32 ) | uint32_t(key.second);
+                    return size_t( ( k * 0x9E3779B97F4A7C15ull ) >> shift );
+                }
+                unsigned find( const bistate &key ) const {
+                    size_t mask = slots.size() - 1;
+                    for( size_t i = at( key ); slots[i].second != empty; i = ( i + 1 ) & mask ) {
+                        if( slots[i].first == key ) {
+                            return slots[i].second;
+                        }
+                    }
+                    return empty;
+                }
+            };
+            std::atomic< const flat * > published;
+            // native tier (see fsm_jit.hpp): set before the slot is installed, its memory owned by `code`
+            unsigned (*native)( int, int ) = 0;
+            std::shared_ptr< const void > code;
+            compiled() : published( 0 )
+            {}
+            ~compiled() {
+                delete published.load();
+            }
+            void build( const fsm::stack::table &sorted ) {
+                flat *f = new flat;
+                unsigned bits = 1;
+                while( ( size_t(1) << bits ) < sorted.size() * 2 ) {
+                    ++bits;
+                }
+                f->shift = 64 - bits;
+                f->slots.assign( size_t(1) << bits, entry( bistate(), empty ) );
+                for( const entry &e : sorted ) {
+                    size_t i = f->at( e.first );
+                    while( f->slots[i].second != empty ) {
+                        i = ( i + 1 ) & ( f->slots.size() - 1 );
+                    }
+                    f->slots[i] = e;
+                }
+                const flat *none = 0;
+                if( !published.compare_exchange_strong( none, f, std::memory_order_acq_rel ) ) {
+                    delete f;
+                }
+            }
+        };
+        struct tier_t {
+            size_t threshold = 0;
+            uint64_t due = 0;
+            std::shared_ptr< compiled > slot;
+        } tier;
+        const std::shared_ptr< compiled > &compiling() {
+            if( !tier.slot ) {
+                tier.slot = std::make_shared< compiled >();
+            }
+            return tier.slot;
+        }
+        void demote() {
+            tier.slot.reset();
+            tier.due = stats.commands + tier.threshold;
+        }
+
+        // sinks are registered with their log by address: copies and moves of a stack start without any.
+        // assigning to a replicated stack keeps its sinks and sends them the new stack (declared after the deque,
+        // so it is already copied by then)
+        typedef std::pair< fsm::changelog *, unsigned > sink;
+        struct sinks_t : std::vector< sink > {
+            stack *owner = 0; // set by replicate()
+            sinks_t()
+            {}
+            sinks_t( const sinks_t & ) : std::vector< sink >()
+            {}
+            sinks_t &operator=( const sinks_t & ) {
+                for( auto &sink : *this ) {
+                    owner->snapshot( sink );
+                }
+                return *this;
+            }
+        } sinks;
+        mutable fsm::counters stats;
+        uint64_t digest = 0;
+        std::vector< uint64_t > since;
+        // observers stay with the machine they registered with: copies and moves of a stack start without any
+        struct observers {
+            fsm::observer *head = 0;
+            observers()
+            {}
+            observers( const observers & )
+            {}
+            observers &operator=( const observers & ) {
+                return *this;
+            }
+        } watchers;
+        friend class fsm::observer;
+        friend class fsm::wal;
+        friend class fsm::jit;
+        friend class fsm::population;
     };
+
+    inline changelog::~changelog() {
+        commit();
+        while( !machines.empty() ) {
+            machines.back()->detach( *this );
+        }
+    }
+
+    inline void observer::detach() {
+        if( owner ) {
+            ( prev ? prev->next : owner->watchers.head ) = next;
+            if( next ) {
+                next->prev = prev;
+            }
+            owner = 0;
+            prev = next = 0;
+        }
+    }
+
+    template<typename iterator>
+    inline bool wal::checkpoint( iterator begin, iterator end ) {
+        std::vector< const fsm::stack * > given( begin, end );
+        std::sort( given.begin(), given.end() );
+        for( const fsm::stack *m : machines ) {
+            if( !std::binary_search( given.begin(), given.end(), m ) ) {
+                return false;
+            }
+        }
+        return checkpoint();
+    }
+
+    inline bool wal::checkpoint() {
+        commit();
+        std::string ckpt = path + ".ckpt", tmp = ckpt + ".tmp";
+        std::FILE *out = std::fopen( tmp.c_str(), "wb" );
+        if( !out ) {
+            return false;
+        }
+        // a machine logging here under several ids is listed once per id
+        std::vector< const fsm::stack * > all( machines.begin(), machines.end() );
+        std::sort( all.begin(), all.end() );
+        all.erase( std::unique( all.begin(), all.end() ), all.end() );
+        std::stringstream ss;
+        ss << seq << '\n';
+        for( const fsm::stack *m : all ) {
+            for( auto &sink : m->sinks ) {
+                if( sink.first != this ) {
+                    continue;
+                }
+                ss << seq << ' ';
+                write( ss, sink.second, 'clr', 0, fsm::state() );
+                for( size_t level = 0; level < m->size(); ++level ) {
+                    ss << seq << ' ';
+                    write( ss, sink.second, 'push', level, m->get_state(level) );
+                }
+            }
+        }
+        std::string data = ss.str();
+        bool ok = std::fwrite( data.data(), 1, data.size(), out ) == data.size() && sync( out );
+        std::fclose( out );
+        if( !ok || std::rename( tmp.c_str(), ckpt.c_str() ) != 0 ) {
+            return false;
+        }
+        // the checkpoint covers whatever a failed commit left buffered
+        buffer.str( std::string() );
+        pending = 0;
+        failed = false;
+        if( fp ) {
+            std::fclose( fp );
+        }
+        fp = std::fopen( path.c_str(), "wb" );
+        return fp != 0;
+    }
+
+    template<typename function>
+    inline size_t changelog::replay( std::FILE *in, const function &lookup, size_t after, size_t *last, long *valid ) {
+        size_t applied = 0, seq, level, nargs, len;
+        unsigned id;
+        int op, name;
+        while( std::fscanf( in, "%zu %u %d %zu %d %zu", &seq, &id, &op, &level, &name, &nargs ) == 6 ) {
+            fsm::args args( nargs );
+            for( auto &arg : args ) {
+                if( std::fscanf( in, "%zu", &len ) != 1 || std::fgetc( in ) != ' ' ) {
+                    return applied;
+                }
+                arg.resize( len );
+                if( len && std::fread( &arg[0], 1, len, in ) != len ) {
+                    return applied;
+                }
+            }
+            if( std::fgetc( in ) != '\n' ) {
+                return applied;
+            }
+            if( last ) {
+                *last = seq;
+            }
+            if( valid ) {
+                *valid = std::ftell( in );
+            }
+            if( seq > after ) {
+                if( fsm::stack *machine = lookup( id ) ) {
+                    fsm::state next( name );
+                    next.args = args;
+                    machine->apply( op, level, next );
+                    ++applied;
+                }
+            }
+        }
+        return applied;
+    }
+
+    // batch commands across machines: [begin,end) of (fsm::stack *, fsm::state) pairs
+    template<typename iterator>
+    inline fsm::bitmap command_batch( iterator begin, iterator end ) {
+        fsm::bitmap handled;
+        handled.reserve( std::distance(begin, end) );
+        for( ; begin != end; ++begin ) {
+            handled.push_back( begin->first->command( begin->second ) );
+        }
+        return handled;
+    }
+
+    // broadcast one trigger to many machines: [begin,end) of fsm::stack *.
+    // args are built once; every handler and log entry shares that immutable payload.
+    template<typename iterator>
+    inline fsm::bitmap broadcast( iterator begin, iterator end, const fsm::state &trigger ) {
+        fsm::bitmap handled;
+        handled.reserve( std::distance(begin, end) );
+        for( ; begin != end; ++begin ) {
+            handled.push_back( (*begin)->command( trigger ) );
+        }
+        return handled;
+    }
+    template<typename iterator, typename T>
+    inline fsm::bitmap broadcast( iterator begin, iterator end, const fsm::state &trigger, const T &arg1 ) {
+        return broadcast( begin, end, trigger(arg1) );
+    }
+    template<typename iterator, typename T, typename U>
+    inline fsm::bitmap broadcast( iterator begin, iterator end, const fsm::state &trigger, const T &arg1, const U &arg2 ) {
+        return broadcast( begin, end, trigger(arg1, arg2) );
+    }
+
+    // [note] populations: many machines sharing one definition, ie, a fsm::stack that only holds on() handlers.
+    //        - machines are rows of one arena (a stride of levels each) plus depth and hash columns (and entry times
+    //          while metrics are enabled); nothing else per machine.
+    //        - commands load a row into the definition, dispatch there and store the row back, so the handlers
+    //          registered on the definition serve every machine. current() tells which machine is running.
+    //        - create() and clone() block-copy a prototype; destroy() releases every row at once. lifecycle handlers
+    //          ('init', 'quit', 'back') only run if the definition has them.
+    //        - the definition is left empty between runs, so its own destructor calls no handler.
+    //        - one thread at a time; a handler may command another machine of the same population.
+    class population {
+    public:
+
+        population( fsm::stack &definition, size_t depth = 4 ) : def( definition ), stride( depth ? depth : 1 )
+        {}
+
+        ~population() {
+            destroy();
+        }
+
+        // create n machines in `start` ('init' runs per machine only if the definition handles it). returns first id
+        size_t create( size_t n, const fsm::state &start = 'null' ) {
+            fsm::state prototype[1] = { start };
+            size_t first = create( n, prototype, prototype + 1 );
+            if( def.handles( start, 'init' ) ) {
+                for( size_t id = first; id < first + n; ++id ) {
+                    run( id, [&]( fsm::stack &m ) { m.call( start, 'init' ); } );
+                }
+            }
+            return first;
+        }
+        // create n copies of an already initialised prototype stack: no handler runs. returns first id
+        size_t clone( size_t n, const fsm::stack &prototype ) {
+            std::vector< fsm::state > levels;
+            for( size_t level = 0; level < prototype.size(); ++level ) {
+                levels.push_back( prototype.get_state( level ) );
+            }
+            return create( n, levels.data(), levels.data() + levels.size() );
+        }
+
+        // destroy every machine. with no 'quit' nor 'back' handlers in the definition this is a single free per column
+        void destroy() {
+            if( def.handles( 'quit' ) || def.handles( 'back' ) ) {
+                for( size_t id = 0; id < depths.size(); ++id ) {
+                    run( id, []( fsm::stack &m ) {
+                        while( m.size() ) {
+                            m.pop();
+                        }
+                    } );
+                }
+            }
+            std::vector< fsm::state >().swap( arena );
+            std::vector< unsigned >().swap( depths );
+            std::vector< uint64_t >().swap( hashes );
+            std::vector< uint64_t >().swap( since );
+            lod.members.assign( lod.periods.size(), std::vector< size_t >() );
+            lod.tier.clear();
+            lod.pos.clear();
+            lod.last.clear();
+        }
+
+        // run fn( definition ) on behalf of machine `id`, then store its resulting stack
+        template<typename function>
+        auto run( size_t id, const function &fn ) -> decltype( fn( std::declval< fsm::stack & >() ) ) {
+            struct scope {
+                population &p;
+                size_t outer;
+                scope( population &p, size_t id ) : p( p ), outer( p.running ) {
+                    if( outer != none ) {
+                        p.store( outer );
+                    }
+                    p.load( id );
+                    p.running = id;
+                }
+                ~scope() {
+                    p.store( p.running );
+                    p.running = outer;
+                    if( outer != none ) {
+                        p.load( outer );
+                    } else {
+                        p.def.assign( p.arena.end(), p.arena.end() );
+                    }
+                }
+            } guard( *this, id );
+            return fn( def );
+        }
+
+        // user commands
+        bool command( size_t id, const fsm::state &trigger ) {
+            return run( id, [&]( fsm::stack &m ) { return m.command( trigger ); } );
+        }
+        template<typename T>
+        bool command( size_t id, const fsm::state &trigger, const T &arg1 ) {
+            return run( id, [&]( fsm::stack &m ) { return m.command( trigger, arg1 ); } );
+        }
+        template<typename T, typename U>
+        bool command( size_t id, const fsm::state &trigger, const T &arg1, const U &arg2 ) {
+            return run( id, [&]( fsm::stack &m ) { return m.command( trigger, arg1, arg2 ); } );
+        }
+        size_t command( size_t id, const fsm::state &trigger, fsm::repeat n ) {
+            return run( id, [&]( fsm::stack &m ) { return m.command( trigger, n ); } );
+        }
+
+        // level of detail: tier t ticks its machines every periods[t] frames, a staggered slice of them per frame,
+        // so the cost of a frame follows the important machines rather than the population. every machine starts
+        // (again) in tier 0
+        void tiers( const std::vector< unsigned > &periods ) {
+            lod = lod_t();
+            lod.periods = periods.empty() ? std::vector< unsigned >( 1, 1u ) : periods;
+            for( unsigned &period : lod.periods ) {
+                period = period ? period : 1;
+            }
+            lod.members.resize( lod.periods.size() );
+            lod.tier.assign( size(), 0 );
+            lod.last.assign( size(), 0 );
+            lod.pos.resize( size() );
+            for( size_t id = 0; id < size(); ++id ) {
+                lod.pos[id] = id;
+                lod.members[0].push_back( id );
+            }
+        }
+        // move a machine to another tier in O(1). moves requested while ticking apply once the frame is done
+        void tier( size_t id, unsigned t ) {
+            if( lod.members.empty() ) {
+                tiers( std::vector< unsigned >() );
+            }
+            if( lod.ticking ) {
+                lod.moves.push_back( std::make_pair( id, t ) );
+                return;
+            }
+            t = (std::min)( t, unsigned( lod.members.size() - 1 ) );
+            std::vector< size_t > &from = lod.members[ lod.tier[id] ];
+            size_t moved = from.back();
+            from[ lod.pos[id] ] = moved;
+            lod.pos[ moved ] = lod.pos[id];
+            from.pop_back();
+            lod.tier[id] = t;
+            lod.pos[id] = lod.members[t].size();
+            lod.members[t].push_back( id );
+        }
+        unsigned tier( size_t id ) const {
+            return lod.members.empty() ? 0 : lod.tier[id];
+        }
+        // advance one frame: every machine due is sent trigger( frames since its last tick[, frames * dt] ).
+        // returns machines ticked
+        size_t tick( const fsm::state &trigger, double dt = 0 ) {
+            if( lod.members.empty() ) {
+                tiers( std::vector< unsigned >() );
+            }
+            uint64_t frame = ++lod.frame;
+            size_t ticked = 0;
+            lod.ticking = true;
+            for( size_t t = 0; t < lod.members.size(); ++t ) {
+                const std::vector< size_t > &members = lod.members[t];
+                size_t period = lod.periods[t];
+                // machines ticked a full period ago (the usual case) share one payload
+                fsm::state usual = dt ? trigger( period, period * dt ) : trigger( period );
+                for( size_t pos = frame % period; pos < members.size(); pos += period ) {
+                    size_t id = members[pos];
+                    uint64_t frames = frame - lod.last[id];
+                    lod.last[id] = frame;
+                    command( id, frames == period ? usual : dt ? trigger( frames, frames * dt ) : trigger( frames ) );
+                    ++ticked;
+                }
+            }
+            lod.ticking = false;
+            std::vector< std::pair< size_t, unsigned > > moves;
+            moves.swap( lod.moves );
+            for( auto &m : moves ) {
+                tier( m.first, m.second );
+            }
+            return ticked;
+        }
+
+        // info
+        size_t size() const {
+            return depths.size();
+        }
+        size_t depth( size_t id ) const {
+            return depths[ id ];
+        }
+        fsm::state get_state( size_t id, signed pos = -1 ) const {
+            signed size = (signed)(depths[ id ]);
+            return size ? row( id )[ pos >= 0 ? pos % size : size - 1 + ((pos+1) % size) ] : fsm::state();
+        }
+        // hash of machine `id` (see stack::hash), kept up to date as it runs
+        uint64_t hash( size_t id ) const {
+            return hashes[ id ];
+        }
+        // population checksum (ie, compared across lockstep peers once per tick): machine hashes mixed with their ids
+        // and xor-ed, reduced over up to `threads` threads. reads only the hash column. threads are spawned per call,
+        // so each one gets at least 64k machines: smaller populations are reduced inline
+        uint64_t checksum( unsigned threads = 0 ) const {
+            enum : size_t { grain = 1 << 16 };
+            size_t n = size();
+            threads = threads ? threads : (std::max)( 1u, std::thread::hardware_concurrency() );
+            threads = unsigned( (std::max)( size_t(1), (std::min)( size_t(threads), n / grain ) ) );
+            size_t chunk = ( n + threads - 1 ) / threads;
+            std::vector< uint64_t > partial( threads, 0 );
+            auto reduce = [&]( unsigned t ) {
+                uint64_t h = 0;
+                for( size_t id = t * chunk, end = (std::min)( n, id + chunk ); id < end; ++id ) {
+                    h ^= fsm::mix( hashes[id] ^ fsm::mix( id ) );
+                }
+                partial[t] = h;
+            };
+            std::vector< std::thread > pool;
+            for( unsigned t = 1; t < threads && t * chunk < n; ++t ) {
+                pool.push_back( std::thread( reduce, t ) );
+            }
+            reduce( 0 );
+            uint64_t h = 0;
+            for( auto &th : pool ) {
+                th.join();
+            }
+            for( uint64_t p : partial ) {
+                h ^= p;
+            }
+            return h;
+        }
+        // machine being run (inside handlers), or size() if none
+        size_t current() const {
+            return running == none ? size() : running;
+        }
+        fsm::stack &definition() const {
+            return def;
+        }
+
+    protected:
+
+        enum : size_t { none = ~size_t(0) };
+
+        size_t create( size_t n, const fsm::state *begin, const fsm::state *end ) {
+            size_t first = depths.size(), depth = end - begin;
+            if( depth > stride ) {
+                reshape( depth );
+            }
+            arena.reserve( ( first + n ) * stride );
+            depths.reserve( first + n );
+            hashes.resize( first + n, fsm::checksum( begin, end ) );
+            for( size_t i = 0; i < n; ++i ) {
+                arena.insert( arena.end(), begin, end );
+                arena.resize( arena.size() + stride - depth );
+                depths.push_back( unsigned(depth) );
+            }
+            if( fsm::metrics::global().enabled() ) {
+                for( const fsm::state *level = begin; level != end; ++level ) {
+                    fsm::metrics::global().entered( level->name, n );
+                }
+                since.resize( arena.size(), fsm::metrics::now() );
+            }
+            // new machines join tier 0, due on the next frame
+            if( lod.members.size() ) {
+                for( size_t id = first; id < first + n; ++id ) {
+                    lod.tier.push_back( 0 );
+                    lod.last.push_back( lod.frame );
+                    lod.pos.push_back( lod.members[0].size() );
+                    lod.members[0].push_back( id );
+                }
+            }
+            return first;
+        }
+
+        fsm::state *row( size_t id ) {
+            return &arena[ id * stride ];
+        }
+        const fsm::state *row( size_t id ) const {
+            return &arena[ id * stride ];
+        }
+
+        // with metrics enabled, entry times travel with the levels, so dwell times span loads and stores.
+        // levels that predate enabling metrics count from their next load
+        void load( size_t id ) {
+            def.assign( row( id ), row( id ) + depths[ id ], hashes[ id ] );
+            if( fsm::metrics::global().enabled() ) {
+                uint64_t now = fsm::metrics::now();
+                since.resize( arena.size(), 0 );
+                uint64_t *entered = &since[ id * stride ];
+                for( size_t level = 0; level < depths[ id ]; ++level ) {
+                    entered[ level ] = entered[ level ] ? entered[ level ] : now;
+                }
+                def.since.assign( entered, entered + depths[ id ] );
+            }
+        }
+        void store( size_t id ) {
+            if( def.size() > stride ) {
+                reshape( def.size() );
+            }
+            fsm::state *levels = row( id );
+            for( size_t level = 0, size = def.size(); level < size; ++level ) {
+                levels[ level ] = def.get_state( level );
+            }
+            for( size_t level = def.size(); level < depths[ id ]; ++level ) {
+                levels[ level ] = fsm::state();
+            }
+            if( since.size() ) {
+                uint64_t *entered = &since[ id * stride ];
+                for( size_t level = 0; level < stride; ++level ) {
+                    entered[ level ] = level < def.since.size() && level < def.size() ? def.since[ level ] : 0;
+                }
+            }
+            depths[ id ] = unsigned( def.size() );
+            hashes[ id ] = def.hash();
+        }
+
+        // deeper stacks than planned: grow every row (rare, amortised by doubling)
+        void reshape( size_t depth ) {
+            size_t wider = (std::max)( depth, stride * 2 );
+            std::vector< fsm::state > grown( depths.size() * wider );
+            std::vector< uint64_t > entered( since.size() ? grown.size() : 0 );
+            for( size_t id = 0; id < depths.size(); ++id ) {
+                std::copy( row( id ), row( id ) + depths[ id ], &grown[ id * wider ] );
+                if( since.size() ) {
+                    std::copy( &since[ id * stride ], &since[ id * stride ] + depths[ id ], &entered[ id * wider ] );
+                }
+            }
+            arena.swap( grown );
+            since.swap( entered );
+            stride = wider;
+        }
+
+        fsm::stack &def;
+        size_t stride, running = none;
+        std::vector< fsm::state > arena;
+        std::vector< unsigned > depths;
+        std::vector< uint64_t > hashes;
+        std::vector< uint64_t > since; // entry time per level (same layout as the arena), only with metrics
+
+        struct lod_t {
+            std::vector< unsigned > periods;              // per tier
+            std::vector< std::vector< size_t > > members; // per tier, unordered
+            std::vector< unsigned > tier;                 // per machine
+            std::vector< size_t > pos;                    // per machine, within members[ tier ]
+            std::vector< uint64_t > last;                 // per machine, frame of its last tick
+            std::vector< std::pair< size_t, unsigned > > moves;
+            uint64_t frame = 0;
+            bool ticking = false;
+        } lod;
+    };
+
+    // [note] asynchronous dispatch, sender/receiver style (no std::execution in C++11, so a minimal type-erased one):
+    //        - a sender does nothing until connect( receiver ).start(); then it eventually calls exactly one of
+    //          receiver.set_value( bool ) or receiver.set_stopped(). operations may be discarded once started.
+    //        - a scheduler is anything that runs a task later (thread pool, event loop...), see fsm::scheduler.
+    //        - fsm::actor runs the triggers of one stack on its scheduler, one at a time and in order. async
+    //          handlers return a sender and keep the machine "in flight" until it completes: new triggers are
+    //          buffered meanwhile, and no thread is blocked.
+    typedef std::function< void( std::function< void() > ) > scheduler;
+
+    // runs tasks right away, in the calling thread
+    inline fsm::scheduler inline_scheduler() {
+        return []( const std::function< void() > &task ) { task(); };
+    }
+
+    class sender {
+    public:
+
+        typedef std::function< void( bool ) > value_fn;
+        typedef std::function< void() > stopped_fn;
+        typedef std::function< void( value_fn, stopped_fn ) > work_fn;
+
+        explicit sender( work_fn work ) : work( std::move(work) )
+        {}
+
+        // already completed sender
+        static sender just( bool value = true ) {
+            return sender( [value]( const value_fn &done, const stopped_fn & ) { done( value ); } );
+        }
+
+        template<typename receiver>
+        struct operation {
+            work_fn work;
+            receiver r;
+            void start() {
+                std::shared_ptr< receiver > self = std::make_shared< receiver >( std::move(r) );
+                work( [self]( bool value ) { self->set_value( value ); }, [self]() { self->set_stopped(); } );
+            }
+        };
+        template<typename receiver>
+        operation< receiver > connect( receiver r ) const {
+            return operation< receiver > { work, std::move(r) };
+        }
+
+    protected:
+
+        work_fn work;
+    };
+
+    typedef std::function< fsm::sender( const fsm::args &args ) > async_call;
+
+    class actor {
+    public:
+
+        actor( fsm::stack &machine, fsm::scheduler sched ) : machine( machine ), sched( std::move(sched) )
+        {}
+
+        // queued triggers that never ran complete as stopped, and the handlers set up by on() stop referring to this
+        // actor: they keep running on the machine, detached. do not destroy an actor with a task still scheduled
+        ~actor() {
+            for( auto &r : registered ) {
+                fsm::async_call fn = r.fn;
+                machine.on( r.from, r.to ) = [fn]( const fsm::args &args ) {
+                    fn( args ).connect( detached() ).start();
+                };
+            }
+            std::deque< item > dropped;
+            {
+                std::lock_guard< std::mutex > lock( mutex );
+                dropped.swap( queue );
+            }
+            for( auto &it : dropped ) {
+                it.stopped();
+            }
+        }
+
+        // sender completing with handled/unhandled once `trigger` has been processed on the scheduler (for async
+        // handlers, once their sender completed)
+        fsm::sender dispatch( const fsm::state &trigger ) {
+            return fsm::sender( [this, trigger]( const fsm::sender::value_fn &done, const fsm::sender::stopped_fn &stopped ) {
+                bool idle;
+                {
+                    std::lock_guard< std::mutex > lock( mutex );
+                    queue.push_back( item { trigger, done, stopped } );
+                    idle = !busy;
+                    busy = true;
+                }
+                if( idle ) {
+                    sched( [this]() { drain(); } );
+                }
+            } );
+        }
+
+        // async setup: the machine stays in flight until the returned sender completes. triggers sent to the machine
+        // directly (machine.command(), not through dispatch()) have nobody to report to: their sender is started
+        // right away and the actor does not wait for it
+        void on( const fsm::state &from, const fsm::state &to, fsm::async_call fn ) {
+            registered.push_back( registration { from, to, fn } );
+            machine.on( from, to ) = [this, fn]( const fsm::args &args ) {
+                if( draining ) {
+                    pending.reset( new fsm::sender( fn( args ) ) );
+                } else {
+                    fn( args ).connect( detached() ).start();
+                }
+            };
+        }
+
+        bool in_flight() const {
+            std::lock_guard< std::mutex > lock( mutex );
+            return flight;
+        }
+        size_t buffered() const {
+            std::lock_guard< std::mutex > lock( mutex );
+            return queue.size();
+        }
+
+    protected:
+
+        struct item {
+            fsm::state trigger;
+            fsm::sender::value_fn done;
+            fsm::sender::stopped_fn stopped;
+        };
+
+        struct registration {
+            fsm::state from, to;
+            fsm::async_call fn;
+        };
+
+        struct detached {
+            void set_value( bool ) {}
+            void set_stopped() {}
+        };
+
+        struct resume {
+            actor *self;
+            fsm::sender::value_fn done;
+            fsm::sender::stopped_fn stopped;
+            void set_value( bool ) {
+                landed();
+                done( true );
+                rearm();
+            }
+            // a cancelled handler cancels the dispatch that ran it
+            void set_stopped() {
+                landed();
+                stopped();
+                rearm();
+            }
+            void landed() {
+                std::lock_guard< std::mutex > lock( self->mutex );
+                self->flight = false;
+            }
+            void rearm() {
+                actor *a = self;
+                a->sched( [a]() { a->drain(); } );
+            }
+        };
+
+        // runs on the scheduler; only one drain (or flight) is active per actor at any time
+        void drain() {
+            for( ;; ) {
+                item next;
+                {
+                    std::lock_guard< std::mutex > lock( mutex );
+                    if( queue.empty() ) {
+                        busy = false;
+                        return;
+                    }
+                    next = std::move( queue.front() );
+                    queue.pop_front();
+                }
+                draining = true;
+                bool handled = machine.command( next.trigger );
+                draining = false;
+                if( pending ) {
+                    std::unique_ptr< fsm::sender > s( std::move(pending) );
+                    {
+                        std::lock_guard< std::mutex > lock( mutex );
+                        flight = true;
+                    }
+                    s->connect( resume { this, std::move(next.done), std::move(next.stopped) } ).start();
+                    return;
+                }
+                next.done( handled );
+            }
+        }
+
+        fsm::stack &machine;
+        fsm::scheduler sched;
+        mutable std::mutex mutex;
+        std::deque< item > queue;
+        std::vector< registration > registered;
+        std::unique_ptr< fsm::sender > pending;
+        bool busy = false, flight = false;
+        bool draining = false; // only touched by drain() and the handlers it runs
+    };
+
+    // runs a trigger on machine `id`, whatever machines are: used by the queues below
+    typedef std::function< bool( size_t machine, const fsm::state &trigger ) > runner;
+
+    // stacks: machine i is *machines[i] (the vector is kept by reference)
+    inline fsm::runner run_on( const std::vector< fsm::stack * > &machines ) {
+        return [&machines]( size_t id, const fsm::state &trigger ) { return machines[id]->command( trigger ); };
+    }
+    inline fsm::runner run_on( fsm::population &machines ) {
+        return [&machines]( size_t id, const fsm::state &trigger ) { return machines.command( id, trigger ); };
+    }
+
+    // [note] fair queue: deficit round-robin over machine inboxes.
+    //        - each round, every machine with queued triggers earns quantum * weight credits and runs one trigger per
+    //          credit, never more than `budget` per round. unspent credits carry over (capped at the budget); an
+    //          emptied inbox forfeits them. chatty machines cannot starve quiet ones beyond their share.
+    //        - a machine weighs its own weight if set, else the weight of its group (ie, one group per definition),
+    //          else 1.
+    //        - machines are plain ids handed to the runner: population ids, indices into a vector of stacks...
+    //        - inboxes are linked lists through one shared event pool, and machines with queued triggers are linked
+    //          through their slots: no allocation per machine nor per trigger once warm. one thread at a time.
+    class fair_queue {
+    public:
+
+        fair_queue( fsm::runner run, unsigned quantum = 1, size_t budget = ~size_t(0) )
+        : run( std::move(run) ), quantum( quantum ? quantum : 1 ), budget( budget ? budget : 1 )
+        {}
+
+        void weight( size_t machine, unsigned w ) {
+            at( machine ).weight = w;
+        }
+        void group( size_t machine, unsigned g ) {
+            at( machine ).group = g;
+        }
+        void group_weight( unsigned g, unsigned w ) {
+            if( g >= groups.size() ) {
+                groups.resize( g + 1, 0 );
+            }
+            groups[g] = w;
+        }
+
+        void post( size_t machine, const fsm::state &trigger ) {
+            size_t e = spare;
+            if( e != none ) {
+                spare = events[e].next;
+                events[e].trigger = trigger;
+                events[e].next = none;
+            } else {
+                e = events.size();
+                events.push_back( event { trigger, none } );
+            }
+            slot &s = at( machine );
+            ( s.tail != none ? events[ s.tail ].next : s.head ) = e;
+            s.tail = e;
+            ++s.queued;
+            ++queued;
+            if( !s.active ) {
+                s.active = true;
+                enqueue( machine );
+            }
+        }
+
+        // one round over the machines with queued triggers. returns triggers run
+        size_t round() {
+            return turns( actives, ~size_t(0) );
+        }
+
+        // rounds until every inbox is empty or `limit` triggers ran. returns triggers run, never more than `limit`:
+        // a machine stopped by the limit finishes its turn (without earning new credits) on the next call
+        size_t drain( size_t limit = ~size_t(0) ) {
+            size_t ran = 0;
+            while( queued && ran < limit ) {
+                ran += turns( actives, limit - ran );
+            }
+            return ran;
+        }
+
+        size_t pending() const {
+            return queued;
+        }
+        size_t pending( size_t machine ) const {
+            return machine < slots.size() ? slots[machine].queued : 0;
+        }
+
+    protected:
+
+        enum : size_t { none = ~size_t(0) };
+
+        struct event {
+            fsm::state trigger;
+            size_t next;
+        };
+        struct slot {
+            size_t head = none, tail = none, queued = 0, deficit = 0, next = none;
+            unsigned weight = 0, group = 0;
+            bool active = false, credited = false;
+        };
+
+        // the next `n` turns of the active list, up to `limit` triggers. the machine taking its turn stays at the
+        // front of the list until the turn is over
+        size_t turns( size_t n, size_t limit ) {
+            size_t ran = 0;
+            for( ; n && ran < limit; --n ) {
+                size_t id = first;
+                if( !slots[id].credited ) {
+                    slots[id].deficit = (std::min)( budget, slots[id].deficit + size_t(quantum) * weight_of( slots[id] ) );
+                    slots[id].credited = true;
+                }
+                while( slots[id].head != none && slots[id].deficit && ran < limit ) {
+                    // runners may post(), which may move slots and events: no references across run()
+                    slot &s = slots[id];
+                    size_t e = s.head;
+                    fsm::state trigger = std::move( events[e].trigger );
+                    s.head = events[e].next;
+                    if( s.head == none ) {
+                        s.tail = none;
+                    }
+                    events[e].trigger = fsm::state();
+                    events[e].next = spare;
+                    spare = e;
+                    --s.queued;
+                    --s.deficit;
+                    --queued;
+                    ++ran;
+                    run( id, trigger );
+                }
+                slot &s = slots[id];
+                if( s.head != none && s.deficit ) {
+                    break; // stopped by the limit: the turn goes on next time
+                }
+                first = s.next;
+                if( first == none ) {
+                    last = none;
+                }
+                --actives;
+                s.credited = false;
+                if( s.head == none ) {
+                    s.deficit = 0;
+                    s.active = false;
+                } else {
+                    enqueue( id );
+                }
+            }
+            return ran;
+        }
+
+        void enqueue( size_t id ) {
+            slots[id].next = none;
+            ( last != none ? slots[last].next : first ) = id;
+            last = id;
+            ++actives;
+        }
+
+        slot &at( size_t machine ) {
+            if( machine >= slots.size() ) {
+                slots.resize( machine + 1 );
+            }
+            return slots[machine];
+        }
+        unsigned weight_of( const slot &s ) const {
+            return s.weight ? s.weight : s.group < groups.size() && groups[ s.group ] ? groups[ s.group ] : 1;
+        }
+
+        fsm::runner run;
+        unsigned quantum;
+        size_t budget, queued = 0, spare = none;
+        std::vector< slot > slots;
+        std::vector< event > events;
+        std::vector< unsigned > groups;
+        size_t first = none, last = none, actives = 0; // machines with queued triggers, in turn order
+    };
+
+    // [note] frame runner: drains queued triggers across machines, highest priority first (fifo within a priority),
+    //        until the frame budget is spent. whatever is left carries over to the next frame, still in priority
+    //        order. the clock (steady_clock, a vdso call on most platforms) is read once every `check` triggers.
+    class frame_runner {
+    public:
+
+        struct report {
+            size_t ran = 0, handled = 0, backlog = 0;
+            uint64_t elapsed_us = 0;
+            bool exhausted = false; // budget spent with triggers still queued
+        };
+
+        frame_runner( fsm::runner run, unsigned check = 1 ) : run( std::move(run) ), check( check ? check : 1 )
+        {}
+
+        void post( size_t machine, const fsm::state &trigger, int priority = 0 ) {
+            queue.push( queued { priority, seq++, machine, trigger } );
+        }
+
+        // run queued triggers for up to `budget_us` microseconds
+        report frame( uint64_t budget_us ) {
+            typedef std::chrono::steady_clock clock;
+            clock::time_point start = clock::now(), now = start, deadline = start + std::chrono::microseconds( budget_us );
+            report r;
+            while( !queue.empty() ) {
+                if( r.ran % check == 0 && ( now = clock::now() ) >= deadline ) {
+                    r.exhausted = true;
+                    break;
+                }
+                queued next = queue.top();
+                queue.pop();
+                r.handled += run( next.machine, next.trigger );
+                ++r.ran;
+            }
+            if( !r.exhausted ) {
+                now = clock::now();
+            }
+            r.backlog = queue.size();
+            r.elapsed_us = (uint64_t)std::chrono::duration_cast< std::chrono::microseconds >( now - start ).count();
+            return r;
+        }
+
+        size_t backlog() const {
+            return queue.size();
+        }
+
+    protected:
+
+        struct queued {
+            int priority;
+            uint64_t seq;
+            size_t machine;
+            fsm::state trigger;
+            bool operator<( const queued &other ) const {
+                // std::priority_queue pops the largest: higher priority, then older
+                return priority != other.priority ? priority < other.priority : seq > other.seq;
+            }
+        };
+
+        fsm::runner run;
+        unsigned check;
+        uint64_t seq = 0;
+        std::priority_queue< queued > queue;
+    };
+
+    // [note] parallel replay of recorded triggers:
+    //        - machines are partitioned by id across threads; each thread replays its machines, in sequence order,
+    //          as a population over its own definition (built by define()), so no handler is shared across threads.
+    //        - a record may name another record (of any machine) that must be replayed first: `after`. a thread only
+    //          waits when that record belongs to another thread that has not reached it yet. every thread goes in
+    //          sequence order and dependencies must point backwards (after >= seq is ignored), so this cannot deadlock.
+    //        - handlers should only change their own machine: effects on other machines are recorded separately.
+    //        - results are per machine: final state, depth and checksum (see fsm::checksum).
+    struct record {
+        uint64_t seq;
+        size_t machine;
+        fsm::state trigger;
+        uint64_t after; // seq of an earlier record that must be replayed first, 0 if none
+    };
+
+    struct replayed {
+        fsm::state state;
+        size_t depth;
+        uint64_t checksum;
+    };
+
+    inline std::vector< fsm::replayed > replay( const std::vector< fsm::record > &trace, size_t machines,
+        const std::function< void( fsm::stack &definition ) > &define, const fsm::state &start = 'null', unsigned threads = 0 ) {
+        threads = threads ? threads : (std::max)( 1u, std::thread::hardware_concurrency() );
+        threads = unsigned( (std::max)( size_t(1), (std::min)( size_t(threads), machines ) ) );
+        // sequence order, once for everybody; then one list per thread
+        std::vector< size_t > order( trace.size() );
+        for( size_t i = 0; i < order.size(); ++i ) {
+            order[i] = i;
+        }
+        std::stable_sort( order.begin(), order.end(), [&]( size_t a, size_t b ) { return trace[a].seq < trace[b].seq; } );
+        std::vector< std::vector< size_t > > partition( threads );
+        for( size_t i : order ) {
+            if( trace[i].machine < machines ) {
+                partition[ trace[i].machine % threads ].push_back( i );
+            }
+        }
+        // progress[t]: seq of the last record replayed by thread t (monotonic)
+        std::unique_ptr< std::atomic< uint64_t >[] > progress( new std::atomic< uint64_t >[ threads ] );
+        for( unsigned t = 0; t < threads; ++t ) {
+            progress[t].store( 0 );
+        }
+        std::vector< fsm::replayed > results( machines );
+        auto worker = [&]( unsigned t ) {
+            fsm::stack definition;
+            define( definition );
+            fsm::population local( definition );
+            local.create( ( machines - t + threads - 1 ) / threads, start );
+            for( size_t i : partition[t] ) {
+                const fsm::record &r = trace[i];
+                // only backward dependencies are honoured: any other would wait forever
+                if( r.after && r.after < r.seq ) {
+                    std::vector< size_t >::const_iterator dep = std::lower_bound( order.begin(), order.end(), r.after,
+                        [&]( size_t j, uint64_t seq ) { return trace[j].seq < seq; } );
+                    if( dep != order.end() && trace[*dep].seq == r.after && trace[*dep].machine < machines ) {
+                        std::atomic< uint64_t > &owner = progress[ trace[*dep].machine % threads ];
+                        while( owner.load( std::memory_order_acquire ) < r.after ) {
+                            std::this_thread::yield();
+                        }
+                    }
+                }
+                local.command( r.machine / threads, r.trigger );
+                progress[t].store( r.seq, std::memory_order_release );
+            }
+            progress[t].store( ~uint64_t(0), std::memory_order_release );
+            for( size_t id = 0; id < local.size(); ++id ) {
+                fsm::replayed &out = results[ id * threads + t ];
+                out.state = local.get_state( id );
+                out.depth = local.depth( id );
+                out.checksum = local.hash( id );
+            }
+        };
+        std::vector< std::thread > pool;
+        for( unsigned t = 1; t < threads; ++t ) {
+            pool.push_back( std::thread( worker, t ) );
+        }
+        worker( 0 );
+        for( auto &th : pool ) {
+            th.join();
+        }
+        return results;
+    }
 }
 
 #ifdef FSM_BUILD_SAMPLE1
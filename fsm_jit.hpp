@@ -0,0 +1,140 @@
+// Native lookup tier for frozen fsm::stack definitions (x86-64 Linux; other targets fall back to stack::promote())
+// - rlyeh [2011..2015], zlib/libpng licensed.
+
+// [note] jit::freeze( definition ) emits a compare/branch tree over the (state,trigger) keys of the definition into
+//        mmap'd memory and installs it as the lookup tier of the stack:
+//        - the emitted function maps (state,trigger) to a handler offset; handlers stay fsm::call objects, invoked by
+//          the stack as usual. category handlers are still looked up by the stack after a native miss.
+//        - the code is released with the tier, ie, when a new transition is registered (back to the sorted table).
+//        - given a symbol name, the function is also listed in /tmp/perf-<pid>.map so `perf report` can symbolize
+//          it. off by default: the map is never cleaned up.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define FSM_JIT 1
+#else
+#define FSM_JIT 0
+#endif
+
+#include "fsm.hpp"
+
+namespace fsm
+{
+    class jit {
+    public:
+
+        // true if native code was installed; false if it fell back to the flat table (ie, unsupported target).
+        // a non-empty symbol lists the code in the perf map under that name
+        static bool freeze( fsm::stack &definition, const std::string &symbol = std::string() ) {
+#if FSM_JIT
+            definition.settle();
+            std::vector< std::pair< uint64_t, unsigned > > keys;
+            keys.reserve( definition.callbacks.size() );
+            for( const fsm::stack::entry &e : definition.callbacks ) {
+                keys.push_back( std::make_pair( key( e.first.first, e.first.second ), e.second ) );
+            }
+            std::sort( keys.begin(), keys.end() );
+            std::vector< unsigned char > code;
+            prologue( code );
+            tree( code, keys, 0, keys.size() );
+            if( void *native = install( code, symbol ) ) {
+                size_t bytes = code.size();
+                std::shared_ptr< fsm::stack::compiled > slot = std::make_shared< fsm::stack::compiled >();
+                slot->native = (unsigned (*)( int, int ))native;
+                slot->code = std::shared_ptr< const void >( native, [bytes]( const void *p ) { munmap( (void *)p, bytes ); } );
+                definition.tier.slot = slot;
+                return true;
+            }
+#endif
+            definition.promote();
+            return false;
+        }
+
+        static bool supported() {
+            return FSM_JIT != 0;
+        }
+
+    protected:
+
+        // native functions compare a single 64-bit key, so the tree is sorted by it rather than by (state,trigger)
+        static uint64_t key( int from, int to ) {
+            return ( uint64_t(uint32_t(from)) << 32 ) | uint32_t(to);
+        }
+
+        static void emit( std::vector< unsigned char > &code, std::initializer_list< unsigned char > bytes ) {
+            code.insert( code.end(), bytes );
+        }
+        template<typename T>
+        static void emit( std::vector< unsigned char > &code, T value ) {
+            for( size_t i = 0; i < sizeof(T); ++i ) {
+                code.push_back( (unsigned char)( uint64_t(value) >> ( 8 * i ) ) );
+            }
+        }
+
+        // rax = (uint32 edi << 32) | uint32 esi
+        static void prologue( std::vector< unsigned char > &code ) {
+            emit( code, { 0x89, 0xF8 } );             // mov eax, edi
+            emit( code, { 0x48, 0xC1, 0xE0, 0x20 } ); // shl rax, 32
+            emit( code, { 0x89, 0xF6 } );             // mov esi, esi
+            emit( code, { 0x48, 0x09, 0xF0 } );       // or rax, rsi
+        }
+
+        // binary search over keys[lo,hi): the right half falls through, the left half is reached with jb
+        static void tree( std::vector< unsigned char > &code, const std::vector< std::pair< uint64_t, unsigned > > &keys, size_t lo, size_t hi ) {
+            if( lo >= hi ) {
+                emit( code, { 0xB8 } );               // mov eax, ~0u
+                emit( code, uint32_t(~0u) );
+                emit( code, { 0xC3 } );               // ret
+                return;
+            }
+            size_t mid = lo + ( hi - lo ) / 2;
+            emit( code, { 0x49, 0xBB } );             // mov r11, key
+            emit( code, keys[mid].first );
+            emit( code, { 0x4C, 0x39, 0xD8 } );       // cmp rax, r11
+            emit( code, { 0x75, 0x06 } );             // jne +6
+            emit( code, { 0xB8 } );                   // mov eax, offset
+            emit( code, uint32_t(keys[mid].second) );
+            emit( code, { 0xC3 } );                   // ret
+            emit( code, { 0x0F, 0x82 } );             // jb left
+            size_t patch = code.size();
+            emit( code, uint32_t(0) );
+            tree( code, keys, mid + 1, hi );
+            uint32_t rel = uint32_t( code.size() - ( patch + 4 ) );
+            for( size_t i = 0; i < 4; ++i ) {
+                code[ patch + i ] = (unsigned char)( rel >> ( 8 * i ) );
+            }
+            tree( code, keys, lo, mid );
+        }
+
+#if FSM_JIT
+        // copy into fresh pages, then flip them to read+exec (never writable and executable at once)
+        static void *install( const std::vector< unsigned char > &code, const std::string &symbol ) {
+            void *mem = mmap( 0, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if( mem == MAP_FAILED ) {
+                return 0;
+            }
+            std::copy( code.begin(), code.end(), (unsigned char *)mem );
+            if( mprotect( mem, code.size(), PROT_READ | PROT_EXEC ) != 0 ) {
+                munmap( mem, code.size() );
+                return 0;
+            }
+            std::string map = "/tmp/perf-" + std::to_string( getpid() ) + ".map";
+            if( std::FILE *fp = symbol.empty() ? 0 : std::fopen( map.c_str(), "a" ) ) {
+                std::fprintf( fp, "%llx %zx %s\n", (unsigned long long)(uintptr_t)mem, code.size(), symbol.c_str() );
+                std::fclose( fp );
+            }
+            return mem;
+        }
+#endif
+    };
+}
@@ -0,0 +1,491 @@
+// Shared-memory populations for fsm::stack (POSIX only)
+// - rlyeh [2011..2015], zlib/libpng licensed.
+
+// [note] a population lives in a shm_open() segment that any process can attach to by name:
+//        - the segment only holds offsets, never pointers, so it can be mapped anywhere.
+//        - every machine has a state column (fixed max depth), a lock-free inbox of trigger ids and counters.
+//        - handlers are process-local: each process attaches the same definition (a fsm::stack with its on()
+//          handlers registered) and drain() runs queued triggers through it on behalf of the shared machine.
+//        - only state names travel through the segment; args are not shared.
+// [note] live statistics: a stats_publisher copies counters, per-state occupancy and a few sampled stacks of a set
+//        of machines (one definition) into a read-only segment; stats_reader (see inspect.cc) copies it out under a
+//        seqlock. the hot path is untouched: machines only bump their own plain counters, publish() does the rest.
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fsm.hpp"
+
+namespace fsm
+{
+    class shared_population {
+    public:
+
+        struct stats {
+            std::atomic<uint64_t> posted, dropped, handled, unhandled;
+            std::atomic<uint64_t> truncated; // levels lost by drain() because the stack outgrew the segment depth
+        };
+
+        // attach to segment `name` ("/my-pool"), creating it with `machines` machines at `start` if it does not exist.
+        // machines == 0 only attaches.
+        shared_population( const std::string &name, uint32_t machines = 0, uint32_t depth = 8, uint32_t inbox = 64, const fsm::state &start = 'null' )
+        : base(0), bytes(0) {
+            int fd = machines ? shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 ) : -1;
+            bool creator = fd >= 0;
+            if( !creator ) {
+                fd = shm_open( name.c_str(), O_RDWR, 0600 );
+            }
+            if( fd < 0 ) {
+                return;
+            }
+            // every machine holds at least its start state. a one-cell ring cannot tell full from ready, so inboxes
+            // hold at least two triggers
+            depth = depth ? depth : 1;
+            inbox = inbox > 2 ? inbox : 2;
+            // inbox positions wrap at 2^32, so its capacity must be a power of two
+            while( inbox & (inbox - 1) ) {
+                inbox += inbox & -inbox;
+            }
+            if( creator ) {
+                uint64_t stride = align( sizeof(slot) + inbox * sizeof(cell) + depth * sizeof(int32_t) );
+                bytes = align( sizeof(header) ) + stride * machines;
+                if( ftruncate( fd, bytes ) != 0 ) {
+                    ::close( fd );
+                    return;
+                }
+            } else {
+                struct stat st;
+                if( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof(header) ) {
+                    ::close( fd );
+                    return;
+                }
+                bytes = st.st_size;
+            }
+            void *map = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            ::close( fd );
+            if( map == MAP_FAILED ) {
+                return;
+            }
+            base = (char *)map;
+            if( creator ) {
+                header &h = *new (base) header();
+                h.version = layout;
+                h.machines = machines;
+                h.depth = depth;
+                h.inbox = inbox;
+                h.stride = align( sizeof(slot) + inbox * sizeof(cell) + depth * sizeof(int32_t) );
+                h.offset = align( sizeof(header) );
+                for( uint32_t i = 0; i < machines; ++i ) {
+                    slot &s = *new (base + h.offset + h.stride * i) slot();
+                    s.depth = 1;
+                    for( uint32_t c = 0; c < inbox; ++c ) {
+                        new (&cells(s)[c]) cell();
+                        cells(s)[c].seq.store( c );
+                    }
+                    levels(s)[0] = start.name;
+                }
+                h.magic.store( signature, std::memory_order_release );
+            } else {
+                // wait for the creator to finish laying out the segment
+                while( head().magic.load( std::memory_order_acquire ) != signature ) {
+                    usleep( 100 );
+                }
+                if( head().version != layout ) {
+                    munmap( base, bytes );
+                    base = 0;
+                }
+            }
+        }
+
+        ~shared_population() {
+            if( base ) {
+                munmap( base, bytes );
+            }
+        }
+
+        // the mapping is owned: attach again by name instead of copying
+        shared_population( const shared_population & ) = delete;
+        shared_population &operator=( const shared_population & ) = delete;
+
+        // remove the segment name; processes already attached keep their mapping
+        static bool unlink( const std::string &name ) {
+            return shm_unlink( name.c_str() ) == 0;
+        }
+
+        bool good() const {
+            return base != 0;
+        }
+
+        uint32_t size() const {
+            return base ? head().machines : 0;
+        }
+
+        // state column
+        uint32_t depth( uint32_t machine ) const {
+            return at( machine ).depth;
+        }
+        fsm::state get_state( uint32_t machine, signed pos = -1 ) const {
+            const slot &s = at( machine );
+            signed size = (signed)s.depth;
+            return size ? fsm::state( levels(s)[ pos >= 0 ? pos % size : size - 1 + ((pos+1) % size) ] ) : fsm::state();
+        }
+
+        // queue a trigger for `machine` from any thread or process (lock-free). false if its inbox is full
+        bool post( uint32_t machine, const fsm::state &trigger ) {
+            slot &s = at( machine );
+            uint32_t capacity = head().inbox;
+            uint32_t pos = s.tail.load( std::memory_order_relaxed );
+            for(;;) {
+                cell &c = cells(s)[ pos % capacity ];
+                int32_t dif = (int32_t)( c.seq.load( std::memory_order_acquire ) - pos );
+                if( dif == 0 ) {
+                    if( s.tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                        c.trigger = trigger.name;
+                        c.seq.store( pos + 1, std::memory_order_release );
+                        s.counters.posted.fetch_add( 1, std::memory_order_relaxed );
+                        head().totals.posted.fetch_add( 1, std::memory_order_relaxed );
+                        return true;
+                    }
+                } else if( dif < 0 ) {
+                    s.counters.dropped.fetch_add( 1, std::memory_order_relaxed );
+                    head().totals.dropped.fetch_add( 1, std::memory_order_relaxed );
+                    return false;
+                } else {
+                    pos = s.tail.load( std::memory_order_relaxed );
+                }
+            }
+        }
+
+        // run up to `budget` queued triggers of `machine` through `definition`, then store the resulting stack back.
+        // a machine is drained by one process at a time; returns false if another one is busy with it, or if the
+        // resulting stack was deeper than the segment holds (top levels are lost and counted in stats::truncated).
+        // a machine left owned by a process that died while draining it is taken over.
+        bool drain( uint32_t machine, fsm::stack &definition, size_t budget = ~size_t(0) ) {
+            slot &s = at( machine );
+            uint32_t owner = 0, self = uint32_t(getpid());
+            while( !s.owner.compare_exchange_strong( owner, self, std::memory_order_acquire ) ) {
+                if( owner == self || alive( owner ) ) {
+                    return false;
+                }
+            }
+            bool loaded = false;
+            int32_t trigger;
+            while( budget && pop( s, trigger ) ) {
+                if( !loaded ) {
+                    // loading is not a change of the machine: no handlers, counters, metrics nor sink records
+                    std::vector< fsm::state > stack( levels(s), levels(s) + s.depth );
+                    definition.assign( stack.begin(), stack.end() );
+                    loaded = true;
+                }
+                bool handled = definition.command( fsm::state( trigger ) );
+                std::atomic<uint64_t> &mine = handled ? s.counters.handled : s.counters.unhandled;
+                std::atomic<uint64_t> &all = handled ? head().totals.handled : head().totals.unhandled;
+                mine.fetch_add( 1, std::memory_order_relaxed );
+                all.fetch_add( 1, std::memory_order_relaxed );
+                --budget;
+            }
+            uint64_t lost = 0;
+            if( loaded ) {
+                uint32_t size = (uint32_t)(std::min)( definition.size(), (size_t)head().depth );
+                for( uint32_t level = 0; level < size; ++level ) {
+                    levels(s)[level] = definition.get_state( level ).name;
+                }
+                s.depth = size;
+                lost = definition.size() - size;
+            }
+            if( lost ) {
+                s.counters.truncated.fetch_add( lost, std::memory_order_relaxed );
+                head().totals.truncated.fetch_add( lost, std::memory_order_relaxed );
+            }
+            s.owner.store( 0, std::memory_order_release );
+            return lost == 0;
+        }
+
+        // counters
+        const stats &totals() const {
+            return head().totals;
+        }
+        const stats &machine_stats( uint32_t machine ) const {
+            return at( machine ).counters;
+        }
+
+    protected:
+
+        enum : uint32_t { signature = 'FSMP', layout = 2 };
+
+        struct header {
+            std::atomic<uint32_t> magic;
+            uint32_t version, machines, depth, inbox;
+            uint64_t stride, offset;
+            stats totals;
+        };
+        struct cell {
+            std::atomic<uint32_t> seq;
+            int32_t trigger;
+        };
+        // followed by cell[inbox] and int32_t level[depth]
+        struct slot {
+            std::atomic<uint32_t> owner, head, tail;
+            uint32_t depth;
+            stats counters;
+        };
+
+        static uint64_t align( uint64_t n ) {
+            return ( n + 63 ) & ~uint64_t(63);
+        }
+        header &head() const {
+            return *(header *)base;
+        }
+        slot &at( uint32_t machine ) const {
+            return *(slot *)( base + head().offset + head().stride * machine );
+        }
+        cell *cells( const slot &s ) const {
+            return (cell *)( (char *)&s + sizeof(slot) );
+        }
+        int32_t *levels( const slot &s ) const {
+            return (int32_t *)( cells(s) + head().inbox );
+        }
+
+        // owners are pids. a recycled pid keeps a dead owner's machine locked until that process exits too
+        static bool alive( uint32_t pid ) {
+            return kill( pid_t(pid), 0 ) == 0 || errno != ESRCH;
+        }
+
+        bool pop( slot &s, int32_t &trigger ) {
+            uint32_t capacity = head().inbox;
+            uint32_t pos = s.head.load( std::memory_order_relaxed );
+            for(;;) {
+                cell &c = cells(s)[ pos % capacity ];
+                int32_t dif = (int32_t)( c.seq.load( std::memory_order_acquire ) - (pos + 1) );
+                if( dif == 0 ) {
+                    if( s.head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                        trigger = c.trigger;
+                        c.seq.store( pos + capacity, std::memory_order_release );
+                        return true;
+                    }
+                } else if( dif < 0 ) {
+                    return false;
+                } else {
+                    pos = s.head.load( std::memory_order_relaxed );
+                }
+            }
+        }
+
+        char *base;
+        uint64_t bytes;
+    };
+
+    // layout shared by stats_publisher and stats_reader
+    class stats_layout {
+    public:
+
+        struct snapshot {
+            uint64_t stamp = 0, machines = 0;
+            fsm::counters totals;
+            std::vector< std::pair< int, uint64_t > > occupancy; // (top state, machines in it)
+            std::vector< std::vector< int > > samples;           // sampled stacks, root first
+        };
+
+    protected:
+
+        enum : uint32_t { signature = 'FSMS', layout = 1 };
+
+        struct header {
+            std::atomic<uint32_t> magic, seq;
+            uint32_t version, max_states, max_samples, sample_depth, states, samples;
+            uint64_t stamp, machines, commands, handled, calls, changes;
+        };
+        struct occupancy {
+            int32_t name;
+            uint64_t count;
+        };
+        // followed by int32_t level[sample_depth]
+        struct sample {
+            uint32_t depth;
+        };
+
+        static uint64_t size( uint32_t max_states, uint32_t max_samples, uint32_t sample_depth ) {
+            return sizeof(header) + max_states * sizeof(occupancy) + max_samples * ( sizeof(sample) + sample_depth * sizeof(int32_t) );
+        }
+        header &head() const {
+            return *(header *)base;
+        }
+        occupancy *states() const {
+            return (occupancy *)( base + sizeof(header) );
+        }
+        sample *sample_at( uint32_t i ) const {
+            return (sample *)( (char *)( states() + head().max_states ) + i * ( sizeof(sample) + head().sample_depth * sizeof(int32_t) ) );
+        }
+        int32_t *levels( sample *s ) const {
+            return (int32_t *)( s + 1 );
+        }
+
+        stats_layout() : base(0), bytes(0)
+        {}
+        ~stats_layout() {
+            if( base ) {
+                munmap( base, bytes );
+            }
+        }
+        // segments are owned: open them again by name instead of copying
+        stats_layout( const stats_layout & ) = delete;
+        stats_layout &operator=( const stats_layout & ) = delete;
+
+        char *base;
+        uint64_t bytes;
+    };
+
+    class stats_publisher : public stats_layout {
+    public:
+
+        // create (or replace) segment `name`. other processes can only map it read-only
+        stats_publisher( const std::string &name, uint32_t max_states = 256, uint32_t max_samples = 16, uint32_t sample_depth = 8 ) {
+            int fd = shm_open( name.c_str(), O_RDWR | O_CREAT, 0644 );
+            if( fd < 0 ) {
+                return;
+            }
+            bytes = size( max_states, max_samples, sample_depth );
+            void *map = ftruncate( fd, bytes ) == 0 ? mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+            ::close( fd );
+            if( map == MAP_FAILED ) {
+                return;
+            }
+            base = (char *)map;
+            header &h = *new (base) header();
+            h.version = layout;
+            h.max_states = max_states;
+            h.max_samples = max_samples;
+            h.sample_depth = sample_depth;
+            h.magic.store( signature, std::memory_order_release );
+        }
+
+        bool good() const {
+            return base != 0;
+        }
+
+        // aggregate [begin,end) of fsm::stack * and publish it. call it at any rate, away from the dispatch loop
+        template<typename iterator>
+        void publish( iterator begin, iterator end ) {
+            if( !base ) {
+                return;
+            }
+            header &h = head();
+            uint64_t machines = std::distance( begin, end ), step = (std::max)( uint64_t(1), machines / (std::max)( h.max_samples, 1u ) );
+            fsm::counters totals;
+            std::map< int, uint64_t > tops;
+            h.seq.fetch_add( 1, std::memory_order_acq_rel );
+            std::atomic_thread_fence( std::memory_order_release );
+            uint32_t samples = 0;
+            for( uint64_t i = 0; begin != end; ++begin, ++i ) {
+                const fsm::stack &m = **begin;
+                const fsm::counters &c = m.get_counters();
+                totals.commands += c.commands;
+                totals.handled += c.handled;
+                totals.calls += c.calls;
+                totals.changes += c.changes;
+                if( m.size() ) {
+                    ++tops[ m.get_state().name ];
+                }
+                if( i % step == 0 && samples < h.max_samples ) {
+                    sample *s = sample_at( samples++ );
+                    s->depth = (uint32_t)(std::min)( m.size(), (size_t)h.sample_depth );
+                    for( uint32_t level = 0; level < s->depth; ++level ) {
+                        levels( s )[level] = m.get_state( level ).name;
+                    }
+                }
+            }
+            h.states = 0;
+            for( auto &top : tops ) {
+                if( h.states < h.max_states ) {
+                    states()[ h.states ].name = top.first;
+                    states()[ h.states++ ].count = top.second;
+                }
+            }
+            h.samples = samples;
+            h.machines = machines;
+            h.commands = totals.commands;
+            h.handled = totals.handled;
+            h.calls = totals.calls;
+            h.changes = totals.changes;
+            h.stamp = (uint64_t)std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::system_clock::now().time_since_epoch() ).count();
+            std::atomic_thread_fence( std::memory_order_release );
+            h.seq.fetch_add( 1, std::memory_order_release );
+        }
+    };
+
+    class stats_reader : public stats_layout {
+    public:
+
+        explicit stats_reader( const std::string &name ) {
+            int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+            if( fd < 0 ) {
+                return;
+            }
+            struct stat st;
+            void *map = fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(header) ? mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+            ::close( fd );
+            if( map == MAP_FAILED ) {
+                return;
+            }
+            base = (char *)map;
+            bytes = st.st_size;
+            if( head().magic.load( std::memory_order_acquire ) != signature || head().version != layout ||
+                bytes < size( head().max_states, head().max_samples, head().sample_depth ) ) {
+                munmap( base, bytes );
+                base = 0;
+            }
+        }
+
+        bool good() const {
+            return base != 0;
+        }
+
+        // copy out a consistent snapshot; never blocks the publisher. false if it kept changing underneath
+        bool read( snapshot &out, unsigned retries = 100 ) const {
+            if( !base ) {
+                return false;
+            }
+            const header &h = head();
+            while( retries-- ) {
+                uint32_t before = h.seq.load( std::memory_order_acquire );
+                if( before & 1 ) {
+                    continue;
+                }
+                out.stamp = h.stamp;
+                out.machines = h.machines;
+                out.totals.commands = h.commands;
+                out.totals.handled = h.handled;
+                out.totals.calls = h.calls;
+                out.totals.changes = h.changes;
+                out.occupancy.resize( (std::min)( h.states, h.max_states ) );
+                for( size_t i = 0; i < out.occupancy.size(); ++i ) {
+                    out.occupancy[i] = std::make_pair( (int)states()[i].name, states()[i].count );
+                }
+                out.samples.resize( (std::min)( h.samples, h.max_samples ) );
+                for( size_t i = 0; i < out.samples.size(); ++i ) {
+                    sample *s = sample_at( (uint32_t)i );
+                    out.samples[i].assign( levels( s ), levels( s ) + (std::min)( s->depth, h.sample_depth ) );
+                }
+                std::atomic_thread_fence( std::memory_order_acquire );
+                if( h.seq.load( std::memory_order_relaxed ) == before ) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+}
@@ -0,0 +1,42 @@
+// live inspector: prints the statistics that a fsm::stats_publisher exposes in shared memory
+// usage: inspect /segment-name [refresh-ms]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include "fsm_shm.hpp"
+
+int main( int argc, const char **argv ) {
+    if( argc < 2 ) {
+        std::cerr << "usage: " << argv[0] << " /segment-name [refresh-ms]" << std::endl;
+        return -1;
+    }
+    fsm::stats_reader reader( argv[1] );
+    if( !reader.good() ) {
+        std::cerr << "cannot attach to " << argv[1] << std::endl;
+        return -1;
+    }
+    int refresh = argc > 2 ? std::atoi( argv[2] ) : 0;
+    do {
+        fsm::stats_reader::snapshot snap;
+        if( reader.read( snap ) ) {
+            std::cout << "stats @" << snap.stamp << " {" << std::endl;
+            std::cout << "\tmachines: " << snap.machines << ", commands: " << snap.totals.commands << ", handled: " << snap.totals.handled;
+            std::cout << ", calls: " << snap.totals.calls << ", changes: " << snap.totals.changes << std::endl;
+            for( auto &state : snap.occupancy ) {
+                std::cout << "\t" << fsm::state( state.first ) << ": " << state.second << std::endl;
+            }
+            for( auto &sample : snap.samples ) {
+                std::string sep = "\t";
+                for( auto it = sample.rbegin(); it != sample.rend(); ++it ) {
+                    std::cout << sep << fsm::state( *it );
+                    sep = " -> ";
+                }
+                std::cout << std::endl;
+            }
+            std::cout << "}" << std::endl;
+        }
+        std::this_thread::sleep_for( std::chrono::milliseconds( refresh ) );
+    } while( refresh > 0 );
+}
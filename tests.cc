@@ -0,0 +1,649 @@
+// behavioural checks, one test_*() per feature
+// usage: tests (POSIX: links with -pthread [-lrt]; scratch files and segments are removed)
+
+#undef NDEBUG
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fsm_jit.hpp"
+#include "fsm_shm.hpp"
+
+namespace
+{
+    std::string scratch( const char *name ) {
+        std::string path = "/tmp/fsm-tests-" + std::to_string( getpid() ) + "-" + name;
+        std::remove( path.c_str() );
+        std::remove( ( path + ".ckpt" ).c_str() );
+        return path;
+    }
+    void cleanup( const std::string &path ) {
+        std::remove( path.c_str() );
+        std::remove( ( path + ".ckpt" ).c_str() );
+    }
+
+    // an ant walks back and forth between -1000 and 1000, one step per tick
+    struct ant {
+        fsm::stack machine;
+        int distance = 0, flow = 1, turns = 0;
+
+        explicit ant( bool bulk ) : machine( 'WALK' ) {
+            machine.on( 'WALK', 'tick' ) = [&]( const fsm::args &args ) {
+                step( 1 );
+            };
+            if( bulk ) {
+                machine.on_repeat( 'WALK', 'tick' ) = [&]( const fsm::args &args, size_t count ) {
+                    size_t until = size_t( std::abs( ( flow > 0 ? 1000 : -1000 ) - distance ) );
+                    return step( (std::min)( count, until ) );
+                };
+            }
+        }
+        size_t step( size_t steps ) {
+            distance += flow * int(steps);
+            if( distance == 1000 || distance == -1000 ) {
+                flow = -flow;
+                ++turns;
+            }
+            return steps;
+        }
+    };
+
+    void test_repeat() {
+        ant single( false ), bulk( true );
+        for( int i = 0; i < 12000; ++i ) {
+            single.machine.command( 'tick' );
+        }
+        uint64_t calls = bulk.machine.get_counters().calls;
+        assert( bulk.machine.command( 'tick', fsm::repeat( 12000 ) ) == 12000 );
+        assert( bulk.machine.get_counters().calls - calls == 7 );
+        assert( single.distance == bulk.distance && single.flow == bulk.flow && single.turns == bulk.turns );
+
+        // plain handlers get one call per repetition, and stop counting once the state has no handler
+        fsm::stack mob( 'DEFN' );
+        int hp = 10;
+        mob.on( 'DEFN', 'tick' ) = [&]( const fsm::args &args ) {
+            if( --hp == 0 ) mob.set( 'DEAD' );
+        };
+        assert( mob.command( 'tick', fsm::repeat( 100 ) ) == 10 && mob.is_state( 'DEAD' ) );
+    }
+
+    void test_wal() {
+        std::string path = scratch( "wal" );
+        {
+            fsm::wal log( path );
+            fsm::stack a( 'WALK' ), b( 'WALK' );
+            a.durable( log, 1 );
+            b.durable( log, 2 );
+            a.push( fsm::state( 'DEFN' )( "with space", 7 ) );
+            b.set( 'RUN1' );
+            assert( log.commit() && log.good() );
+            std::vector< fsm::stack * > all { &a, &b };
+            assert( log.checkpoint( all.begin(), all.end() ) );
+            b.push( 'JUMP' );
+            log.commit();
+        }
+        // a crash in the middle of a record leaves a torn tail: recovery stops there and the next writer cuts it
+        if( std::FILE *fp = std::fopen( path.c_str(), "ab" ) ) {
+            std::fputs( "9 1 1936942450 0 12", fp );
+            std::fclose( fp );
+        }
+        {
+            fsm::wal log( path );
+            assert( log.good() );
+            fsm::stack c( 'IDLE' );
+            c.durable( log, 3 );
+            c.set( 'BUSY' );
+            assert( log.commit() );
+        }
+        fsm::stack a, b, c;
+        fsm::wal::recover( path, [&]( unsigned id ) {
+            return id == 1 ? &a : id == 2 ? &b : id == 3 ? &c : (fsm::stack *)0;
+        } );
+        assert( a.size() == 2 && a.get_state().name == 'DEFN' && a.get_state().args[0] == "with space" );
+        assert( b.size() == 2 && b.get_state().name == 'JUMP' && b.get_state( 0 ).name == 'RUN1' );
+        assert( c.size() == 1 && c.get_state().name == 'BUSY' );
+        cleanup( path );
+
+        // rewind() and assign() reach the log as whole snapshots
+        path = scratch( "snapshots" );
+        {
+            fsm::wal log( path );
+            fsm::stack m( 'AAAA' ), n( 'XXXX' );
+            m.journal( 16 );
+            m.durable( log, 1 );
+            n.durable( log, 2 );
+            m.push( 'BBBB' );
+            m.rewind( 1 );
+            fsm::state levels[] = { 'CCCC', 'DDDD' };
+            n.assign( levels, levels + 2 );
+            log.commit();
+        }
+        fsm::stack m, n;
+        fsm::wal::recover( path, [&]( unsigned id ) {
+            return id == 1 ? &m : &n;
+        } );
+        assert( m.size() == 1 && m.get_state().name == 'AAAA' );
+        assert( n.size() == 2 && n.get_state().name == 'DDDD' );
+        cleanup( path );
+
+        // a checkpoint truncates the log, so it covers every machine logging there, listed or not
+        path = scratch( "coverage" );
+        {
+            fsm::wal log( path );
+            fsm::stack listed( 'AAAA' ), unlisted( 'XXXX' );
+            listed.durable( log, 1 );
+            unlisted.durable( log, 2 );
+            unlisted.durable( log, 3 );
+            unlisted.set( 'YYYY' );
+            std::vector< fsm::stack * > some { &listed };
+            assert( !log.checkpoint( some.begin(), some.end() ) );
+            assert( log.checkpoint() );
+        }
+        fsm::stack listed, unlisted, again;
+        fsm::wal::recover( path, [&]( unsigned id ) {
+            return id == 1 ? &listed : id == 2 ? &unlisted : &again;
+        } );
+        assert( listed.get_state().name == 'AAAA' && unlisted.get_state().name == 'YYYY' && again.get_state().name == 'YYYY' );
+        cleanup( path );
+
+        // failed writes are reported and the batch is kept for the next commit
+        if( std::FILE *full = std::fopen( "/dev/full", "wb" ) ) {
+            std::setvbuf( full, 0, _IONBF, 0 );
+            {
+                fsm::changelog log( full );
+                fsm::stack m( 'AAAA' );
+                m.replicate( log, 1 );
+                m.set( 'BBBB' );
+                assert( log.commit() == 0 && !log.good() );
+                assert( log.commit() == 0 );
+            }
+            std::fclose( full );
+        }
+    }
+    void test_shared_population() {
+        std::string name = "/fsm-tests-" + std::to_string( getpid() );
+        fsm::shared_population::unlink( name );
+        {
+            // inbox 0 is clamped rather than dividing by zero
+            fsm::shared_population pool( name, 8, 2, 0, 'WALK' );
+            assert( pool.good() && pool.size() == 8 && pool.get_state( 7 ).name == 'WALK' );
+            assert( pool.post( 0, 'tick' ) && pool.post( 0, 'tick' ) && !pool.post( 0, 'tick' ) );
+            assert( pool.totals().dropped == 1 );
+
+            // workers attach by name and drain with their own copy of the definition
+            for( int worker = 0; worker < 2; ++worker ) {
+                if( !fork() ) {
+                    fsm::shared_population attached( name );
+                    fsm::stack definition;
+                    definition.on( 'WALK', 'tick' ) = [&]( const fsm::args &args ) {
+                        definition.push( 'RUN1' );
+                    };
+                    for( uint32_t m = 1 + worker; m < 8; m += 2 ) {
+                        attached.post( m, 'tick' );
+                    }
+                    for( uint32_t m = 1; m < 8; ++m ) {
+                        attached.drain( m, definition );
+                    }
+                    _exit( 0 );
+                }
+            }
+            int status;
+            while( wait( &status ) > 0 ) {}
+
+            fsm::stack definition;
+            definition.on( 'WALK', 'tick' ) = [&]( const fsm::args &args ) {
+                definition.push( 'RUN1' );
+            };
+            definition.on( 'RUN1', 'tick' ) = [&]( const fsm::args &args ) {
+                definition.set( 'RUN2' );
+            };
+            definition.on( 'RUN2', 'grow' ) = [&]( const fsm::args &args ) {
+                definition.push( 'RUN3' );
+            };
+            for( uint32_t m = 1; m < 8; ++m ) {
+                assert( pool.drain( m, definition ) );
+                assert( pool.depth( m ) == 2 && pool.get_state( m ).name == 'RUN1' );
+            }
+            assert( pool.drain( 0, definition ) && pool.get_state( 0 ).name == 'RUN2' );
+            // a third level does not fit in depth 2: drain() says so and counts the lost level
+            assert( pool.post( 0, 'grow' ) && !pool.drain( 0, definition ) );
+            assert( pool.depth( 0 ) == 2 && pool.totals().truncated == 1 && pool.machine_stats( 0 ).truncated == 1 );
+
+            // a worker dying mid-drain does not lock its machine forever
+            pid_t child = fork();
+            if( !child ) {
+                fsm::shared_population attached( name );
+                fsm::stack dying;
+                dying.on( 'RUN1', 'tick' ) = [&]( const fsm::args &args ) {
+                    kill( getpid(), SIGKILL );
+                };
+                attached.post( 1, 'tick' );
+                attached.drain( 1, dying );
+                _exit( 0 );
+            }
+            waitpid( child, &status, 0 );
+            assert( pool.post( 1, 'tick' ) && pool.drain( 1, definition ) && pool.get_state( 1 ).name == 'RUN2' );
+
+            // loading a machine into its definition is not a change: only what the handlers do is counted
+            fsm::stack idle;
+            idle.on( 'RUN1', 'tick' ) = [&]( const fsm::args &args ) {};
+            uint64_t changes = idle.get_counters().changes;
+            assert( pool.post( 2, 'tick' ) && pool.drain( 2, idle ) && pool.post( 2, 'tick' ) && pool.drain( 2, idle ) );
+            assert( idle.get_counters().handled == 2 && idle.get_counters().changes == changes );
+        }
+        fsm::shared_population::unlink( name );
+    }
+    void test_jit() {
+        int hits = 0;
+        std::vector< fsm::rule > rules;
+        for( int s = -300; s < 300; s += 3 ) {
+            for( int t = 0; t < 8; ++t ) {
+                rules.push_back( { fsm::state( s ), fsm::state( 1000 + t ), [&, s, t]( const fsm::args &args ) { hits += 1 + s * 8 + t; } } );
+            }
+        }
+        fsm::stack table( fsm::state( 0 ) ), native( fsm::state( 0 ) );
+        table.on( rules );
+        native.on( rules );
+        bool frozen = fsm::jit::freeze( native );
+        assert( frozen == fsm::jit::supported() );
+        // same handler (or the same miss) as the sorted table for every key, including the ones around each rule
+        for( int s = -302; s < 302; ++s ) {
+            for( int t = -2; t < 10; ++t ) {
+                int before = hits;
+                bool expected = table.call( fsm::state( s ), fsm::state( 1000 + t ) );
+                int delta = hits - before;
+                assert( native.call( fsm::state( s ), fsm::state( 1000 + t ) ) == expected && hits - before == 2 * delta );
+            }
+        }
+        // registering a transition drops the native tier
+        native.on( fsm::state( 0 ), 'zzzz' ) = [&]( const fsm::args &args ) { hits = -1; };
+        assert( native.command( 'zzzz' ) && hits == -1 );
+        fsm::stack empty;
+        fsm::jit::freeze( empty );
+        assert( !empty.command( 'tick' ) );
+    }
+    void test_fair_queue() {
+        std::vector< size_t > order;
+        fsm::fair_queue queue( [&]( size_t machine, const fsm::state &trigger ) {
+            order.push_back( machine );
+            return true;
+        }, 1, 2 );
+        for( int i = 0; i < 100; ++i ) {
+            queue.post( 0, 'tick' );
+        }
+        for( size_t m = 1; m <= 5; ++m ) {
+            queue.post( m, 'tick' );
+        }
+        // a chatty machine does not starve quiet ones: everybody gets one quantum per round
+        assert( queue.pending() == 105 && queue.round() == 6 );
+        for( size_t m = 1; m <= 5; ++m ) {
+            assert( queue.pending( m ) == 0 );
+        }
+        // weights are capped by the per-round budget
+        queue.weight( 0, 5 );
+        order.clear();
+        queue.round();
+        assert( order.size() == 2 );
+        // machines without a weight of their own take their group's
+        queue.group( 7, 3 );
+        queue.group_weight( 3, 2 );
+        queue.post( 7, 'tick' );
+        queue.post( 7, 'tick' );
+        queue.post( 7, 'tick' );
+        order.clear();
+        queue.round();
+        assert( std::count( order.begin(), order.end(), 7 ) == 2 );
+        queue.drain();
+        assert( queue.pending() == 0 );
+
+        // drain( limit ) stops right at the limit; the interrupted turn resumes without earning again
+        fsm::fair_queue limited( [&]( size_t machine, const fsm::state &trigger ) {
+            order.push_back( machine );
+            return true;
+        }, 2 );
+        for( size_t m = 0; m < 3; ++m ) {
+            for( int i = 0; i < 4; ++i ) {
+                limited.post( m, 'tick' );
+            }
+        }
+        order.clear();
+        assert( limited.drain( 3 ) == 3 && limited.drain( 3 ) == 3 );
+        assert( ( order == std::vector< size_t > { 0, 0, 1, 1, 2, 2 } ) );
+        assert( limited.drain() == 6 && limited.pending() == 0 );
+
+        // handlers may post again while the queue runs them
+        fsm::stack definition;
+        fsm::population machines( definition );
+        machines.create( 3, 'idle' );
+        int handled = 0;
+        fsm::fair_queue looping( fsm::run_on( machines ) );
+        definition.on( 'idle', 'tick' ) = [&]( const fsm::args &args ) {
+            if( ++handled < 10 ) looping.post( machines.current(), 'tick' );
+        };
+        looping.post( 1, 'tick' );
+        assert( looping.drain() == 10 && handled == 10 );
+    }
+
+    // records the triggers its machine reports, in order
+    struct recorder : fsm::observer {
+        std::vector< std::string > seen;
+        void notify( const fsm::stack &machine, const fsm::transition &t ) {
+            std::stringstream ss;
+            ss << t.trigger;
+            seen.push_back( ss.str() );
+        }
+    };
+
+    void test_batch() {
+        std::vector< fsm::state > triggers { 'walk', 'nope', fsm::state( 'jump' )( 3 ), 'land', 'walk', 'nope' };
+        fsm::bitmap looped;
+        std::vector< std::string > seen[2], states[2];
+        for( int batch = 0; batch < 2; ++batch ) {
+            fsm::stack m( 'idle' );
+            m.on( 'idle', 'walk' ) = [&]( const fsm::args &args ) { m.set( 'WALK' ); };
+            m.on( 'WALK', 'jump' ) = [&]( const fsm::args &args ) { m.push( 'JUMP' ); };
+            m.on( 'JUMP', 'land' ) = [&]( const fsm::args &args ) { m.pop(); };
+            m.on( 'WALK', 'walk' ) = [&]( const fsm::args &args ) {};
+            recorder r;
+            m.observe( r );
+            fsm::bitmap handled;
+            if( batch ) {
+                handled = m.command_batch( triggers.data(), triggers.size() );
+            } else {
+                for( const fsm::state &t : triggers ) {
+                    handled.push_back( m.command( t ) );
+                }
+            }
+            // same handled bits, transitions, reported triggers and counters as a loop of command()
+            if( batch ) {
+                assert( handled == looped );
+            }
+            looped = handled;
+            seen[batch] = r.seen;
+            std::stringstream ss;
+            ss << m.get_log() << ' ' << m.get_state() << ' ' << m.get_trigger() << ' ' << m.get_counters().commands << ' ' << m.get_counters().handled;
+            states[batch].push_back( ss.str() );
+        }
+        assert( ( looped == fsm::bitmap { 1, 0, 1, 1, 1, 0 } ) );
+        assert( seen[0] == seen[1] && states[0] == states[1] );
+    }
+
+    void test_metrics() {
+        fsm::metrics &m = fsm::metrics::global();
+        for( int state : { 1024, 1025, 65, int('go'), int('1024'), int( 0xff676f00 ) } ) {
+            m.entered( state );
+        }
+        std::stringstream ss;
+        m.render( ss );
+        std::string out = ss.str();
+        // distinct, printable labels: numeric ids are never mistaken for the fourcc that prints alike
+        for( const std::string &label : std::vector< std::string > { "#1024", "#1025", "#65", "go", "1024", "#" + std::to_string( int( 0xff676f00 ) ) } ) {
+            assert( out.find( "fsm_state_entries_total{state=\"" + label + "\"}" ) != std::string::npos );
+        }
+        for( char ch : out ) {
+            assert( ch == '\n' || ( (unsigned char)ch >= 0x20 && (unsigned char)ch < 0x7f ) );
+        }
+    }
+    // records how a sender completed: 1/0 for handled/unhandled, -1 for stopped
+    struct outcome {
+        int *result;
+        void set_value( bool handled ) {
+            *result = handled;
+        }
+        void set_stopped() {
+            *result = -1;
+        }
+    };
+
+    void test_actor() {
+        std::vector< std::function< void() > > tasks;
+        fsm::scheduler sched = [&]( std::function< void() > task ) { tasks.push_back( task ); };
+        auto run = [&]() {
+            while( !tasks.empty() ) {
+                std::function< void() > task = tasks.front();
+                tasks.erase( tasks.begin() );
+                task();
+            }
+        };
+        // the async handler hands its completion over to the test, which lands or cancels it later
+        fsm::sender::value_fn land;
+        fsm::sender::stopped_fn cancel;
+        int started = 0;
+        fsm::async_call load = [&]( const fsm::args &args ) {
+            ++started;
+            return fsm::sender( [&]( const fsm::sender::value_fn &done, const fsm::sender::stopped_fn &stopped ) {
+                land = done;
+                cancel = stopped;
+            } );
+        };
+        fsm::stack machine( 'idle' );
+        int first = 2, second = 2, third = 2, fourth = 2;
+        {
+            fsm::actor a( machine, sched );
+            a.on( 'idle', 'load', load );
+            a.dispatch( 'load' ).connect( outcome { &first } ).start();
+            a.dispatch( 'load' ).connect( outcome { &second } ).start();
+            run();
+            assert( started == 1 && a.in_flight() && a.buffered() == 1 && first == 2 );
+            land( true );
+            run();
+            assert( first == 1 && started == 2 && a.in_flight() );
+            // a cancelled handler reports its dispatch as stopped, not as handled
+            cancel();
+            run();
+            assert( second == -1 && !a.in_flight() );
+            a.dispatch( 'nope' ).connect( outcome { &third } ).start();
+            run();
+            assert( third == 0 );
+            // never ran: stopped by the destructor
+            a.dispatch( 'load' ).connect( outcome { &fourth } ).start();
+            tasks.clear();
+        }
+        assert( fourth == -1 && started == 2 );
+        // the handler outlives the actor, detached from it
+        assert( machine.command( 'load' ) && started == 3 );
+        land( true );
+    }
+    // levels of a stack, bottom first
+    std::vector< int > levels( const fsm::stack &m ) {
+        std::vector< int > out;
+        for( size_t level = 0; level < m.size(); ++level ) {
+            out.push_back( m.get_state( level ).name );
+        }
+        return out;
+    }
+
+    void test_rewind() {
+        fsm::stack m( 'idle' );
+        int quits = 0;
+        m.on( 'JUMP', 'quit' ) = [&]( const fsm::args &args ) { ++quits; };
+        m.journal( 4, 2 );
+        std::vector< std::vector< int > > seen { levels( m ) };
+        m.push( 'WALK' ), seen.push_back( levels( m ) );
+        m.set( 'RUN1' ), seen.push_back( levels( m ) );
+        m.push( 'JUMP' ), seen.push_back( levels( m ) );
+        m.pop(), seen.push_back( levels( m ) );
+        m.set( 'RUN2' ), seen.push_back( levels( m ) );
+        assert( quits == 1 );
+        // back one change, then further: handlers stay quiet and the hash follows
+        assert( m.rewind( 1 ) == 1 && levels( m ) == seen[4] );
+        assert( m.rewind( 2 ) == 2 && levels( m ) == seen[2] && quits == 1 );
+        assert( m.hash() == fsm::checksum( &seen[2][0], &seen[2][0] + seen[2].size() ) );
+        // only `capacity` changes are kept, and the journal goes on from the rewound stack
+        assert( m.rewind( 10 ) == 1 && levels( m ) == seen[1] && m.rewind( 1 ) == 0 );
+        m.push( 'JUMP' );
+        assert( m.rewind( 1 ) == 1 && levels( m ) == seen[1] && quits == 1 );
+    }
+    void test_population() {
+        fsm::stack definition;
+        fsm::population crowd( definition, 1 );
+        int inits = 0, quits = 0;
+        size_t walker = ~size_t(0);
+        definition.on( 'idle', 'init' ) = [&]( const fsm::args &args ) { ++inits; };
+        definition.on( 'idle', 'walk' ) = [&]( const fsm::args &args ) {
+            walker = crowd.current();
+            definition.push( 'WALK' );
+        };
+        definition.on( 'WALK', 'quit' ) = [&]( const fsm::args &args ) { ++quits; };
+        assert( crowd.create( 3, 'idle' ) == 0 && crowd.size() == 3 && inits == 3 );
+        // one definition serves every machine, and is left empty between runs
+        assert( crowd.command( 1, 'walk' ) && walker == 1 && definition.size() == 0 );
+        assert( crowd.depth( 1 ) == 2 && crowd.get_state( 1 ).name == 'WALK' && crowd.get_state( 1, 0 ).name == 'idle' );
+        assert( crowd.depth( 0 ) == 1 && crowd.get_state( 0 ).name == 'idle' && !crowd.command( 0, 'nope' ) );
+        assert( crowd.current() == crowd.size() );
+        // clones copy the prototype as is: no 'init'
+        fsm::stack prototype( 'idle' );
+        prototype.push( 'WALK' );
+        assert( crowd.clone( 2, prototype ) == 3 && inits == 3 && crowd.depth( 4 ) == 2 && crowd.get_state( 4 ).name == 'WALK' );
+        // teardown pops every level of every machine
+        crowd.destroy();
+        assert( crowd.size() == 0 && quits == 3 && definition.size() == 0 );
+    }
+    void test_replay() {
+        std::atomic< bool > pinged( false );
+        bool ordered = true;
+        auto define = [&]( fsm::stack &definition ) {
+            definition.on( 'idle', 'tick' ) = [&definition]( const fsm::args &args ) { definition.set( 'TICK' ); };
+            definition.on( 'TICK', 'tick' ) = [&definition]( const fsm::args &args ) { definition.push( 'DEEP' ); };
+            definition.on( 'DEEP', 'back' ) = [&definition]( const fsm::args &args ) { definition.pop(); };
+            definition.on( 'idle', 'ping' ) = [&]( const fsm::args &args ) { pinged = true; };
+            definition.on( 'idle', 'pong' ) = [&]( const fsm::args &args ) { ordered = ordered && pinged; };
+        };
+        const size_t machines = 5;
+        std::vector< fsm::record > trace;
+        uint64_t seq = 0;
+        for( int round = 0; round < 3; ++round ) {
+            for( size_t m = 0; m < machines; ++m ) {
+                // forward and self dependencies are ignored rather than waited for
+                trace.push_back( { ++seq, m, m + round == 4 ? 'back' : 'tick', round == 1 ? seq + 3 : round == 2 ? seq : 0 } );
+            }
+        }
+        // pong on machine 2 must wait for ping on machine 1, whichever thread runs it
+        trace.insert( trace.begin(), { { 1000, 2, 'pong', 999 }, { 999, 1, 'ping', 0 } } );
+        // reference: every machine commanded on its own, in sequence order
+        std::vector< fsm::record > sorted( trace );
+        std::stable_sort( sorted.begin(), sorted.end(), []( const fsm::record &a, const fsm::record &b ) { return a.seq < b.seq; } );
+        std::vector< std::vector< int > > expected;
+        for( size_t m = 0; m < machines; ++m ) {
+            fsm::stack definition( 'idle' );
+            define( definition );
+            for( const fsm::record &r : sorted ) {
+                if( r.machine == m ) definition.command( r.trigger );
+            }
+            expected.push_back( levels( definition ) );
+        }
+        for( unsigned threads : { 1u, 2u, 4u, 8u } ) {
+            pinged = false;
+            std::vector< fsm::replayed > results = fsm::replay( trace, machines, define, 'idle', threads );
+            assert( results.size() == machines );
+            for( size_t m = 0; m < machines; ++m ) {
+                const std::vector< int > &e = expected[m];
+                assert( results[m].state.name == e.back() && results[m].depth == e.size() );
+                assert( results[m].checksum == fsm::checksum( e.begin(), e.end() ) );
+            }
+        }
+        assert( ordered );
+    }
+    void test_hash() {
+        // a stack keeps the hash of its levels, args included, through every kind of change
+        fsm::stack m( 'idle' );
+        std::vector< fsm::state > stack { 'idle', fsm::state( 'WALK' )( "north", 3 ) };
+        m.push( stack[1] );
+        assert( m.hash() == fsm::checksum( stack.begin(), stack.end() ) );
+        m.set( 'RUN1' ), stack[1] = 'RUN1';
+        assert( m.hash() == fsm::checksum( stack.begin(), stack.end() ) );
+        m.pop(), stack.pop_back();
+        assert( m.hash() == fsm::checksum( stack.begin(), stack.end() ) );
+        assert( m.hash() != fsm::checksum( stack.begin(), stack.begin() ) );
+
+        // machines of a population keep theirs too; the population checksum is the same however many threads reduce it
+        fsm::stack definition;
+        definition.on( 'idle', 'walk' ) = [&]( const fsm::args &args ) { definition.push( 'WALK' ); };
+        fsm::population crowd( definition, 1 );
+        crowd.create( 150000, 'idle' );
+        for( size_t id = 0; id < crowd.size(); id += 7 ) {
+            crowd.command( id, 'walk' );
+        }
+        std::vector< int > walking { 'idle', 'WALK' };
+        assert( crowd.hash( 7 ) == fsm::checksum( walking.begin(), walking.end() ) );
+        assert( crowd.hash( 8 ) == fsm::checksum( walking.begin(), walking.begin() + 1 ) );
+        uint64_t reference = 0;
+        for( size_t id = 0; id < crowd.size(); ++id ) {
+            reference ^= fsm::mix( crowd.hash( id ) ^ fsm::mix( id ) );
+        }
+        assert( crowd.checksum( 1 ) == reference && crowd.checksum( 4 ) == reference && crowd.checksum() == reference );
+        crowd.command( 8, 'walk' );
+        assert( crowd.checksum( 4 ) != reference );
+    }
+    void test_changelog() {
+        // machines and logs may die in any order; copies of a machine are not replicated
+        std::FILE *stream = std::tmpfile();
+        fsm::stack *survivor = new fsm::stack( 'AAAA' );
+        {
+            fsm::changelog log( stream );
+            survivor->replicate( log, 1 );
+            fsm::stack copy( *survivor );
+            copy.set( 'CCCC' );
+            {
+                fsm::stack gone( 'XXXX' );
+                gone.replicate( log, 2 );
+            }
+            fsm::stack detached( 'YYYY' );
+            detached.replicate( log, 3 );
+            detached.detach( log );
+            detached.set( 'ZZZZ' );
+            survivor->set( 'BBBB' );
+            assert( log.sequence() == 7 );
+        }
+        survivor->set( 'DDDD' );
+        delete survivor;
+        std::rewind( stream );
+        fsm::stack follower;
+        assert( fsm::changelog::replay( stream, [&]( unsigned id ) {
+            return id == 1 ? &follower : (fsm::stack *)0;
+        } ) == 3 );
+        assert( follower.size() == 1 && follower.get_state().name == 'BBBB' );
+        std::fclose( stream );
+
+        // assigning to a replicated machine streams the stack it got
+        stream = std::tmpfile();
+        {
+            fsm::changelog log( stream );
+            fsm::stack replicated( 'AAAA' ), source( 'BBBB' );
+            source.push( 'CCCC' );
+            replicated.replicate( log, 1 );
+            replicated = source;
+            replicated.set( 'DDDD' );
+        }
+        std::rewind( stream );
+        fsm::stack assigned;
+        fsm::changelog::replay( stream, [&]( unsigned id ) {
+            return id == 1 ? &assigned : (fsm::stack *)0;
+        } );
+        assert( ( levels( assigned ) == std::vector< int > { 'BBBB', 'DDDD' } ) );
+        std::fclose( stream );
+    }
+}
+
+int main() {
+    test_repeat();
+    test_wal();
+    test_shared_population();
+    test_jit();
+    test_fair_queue();
+    test_batch();
+    test_metrics();
+    test_actor();
+    test_rewind();
+    test_population();
+    test_replay();
+    test_hash();
+    test_changelog();
+    std::cout << "ok" << std::endl;
+}